@@ -35,6 +35,7 @@ public class DynamicTerrain : ModuleRules
 			{
 				"CoreUObject",
 				"Engine",
+				"Projects",
 				"RenderCore",
 				"RHI",
 			}
@@ -1,12 +1,23 @@
 // Copyright  2019 Created by Brian Faubion
 
 #include "DynamicTerrain.h"
+#include "TerrainStat.h"
+
+#include "Interfaces/IPluginManager.h"
+#include "Misc/Paths.h"
+#include "ShaderCore.h"
 
 #define LOCTEXT_NAMESPACE "FDynamicTerrainModule"
 
+DEFINE_LOG_CATEGORY(LogDynamicTerrain);
+
 void FDynamicTerrainModule::StartupModule()
 {
 	// This code will execute after your module is loaded into memory; the exact timing is specified in the .uplugin file per-module
+
+	// Map the plugin shader directory so the terrain vertex factory can be compiled
+	FString shader_directory = FPaths::Combine(IPluginManager::Get().FindPlugin(TEXT("DynamicTerrain"))->GetBaseDir(), TEXT("Shaders"));
+	AddShaderSourceDirectoryMapping(TEXT("/Plugin/DynamicTerrain"), shader_directory);
 }
 
 void FDynamicTerrainModule::ShutdownModule()
@@ -9,8 +9,10 @@
 #include "DynamicMeshBuilder.h"
 #include "Materials/Material.h"
 #include "Engine/CollisionProfile.h"
+#include "Async/Async.h"
 
 DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Rebuild Collision"), STAT_DynamicTerrain_RebuildCollision, STATGROUP_DynamicTerrain)
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Finish Component Update"), STAT_DynamicTerrain_FinishUpdate, STATGROUP_DynamicTerrain)
 
 /// Mesh Component Interface ///
 
@@ -20,6 +22,14 @@ UTerrainComponent::UTerrainComponent(const FObjectInitializer& ObjectInitializer
 	Tiling = 1.0f;
 	LODs = 1;
 	LODScale = 0.5;
+	LODErrorThreshold = 2.0f;
+	ShadowLODBias = 1;
+	AdaptiveTriangulation = false;
+	AdaptiveErrorThreshold = 0.5f;
+	StreamedIn = true;
+	XOffset = 0;
+	YOffset = 0;
+	ComponentCount = FIntPoint::ZeroValue;
 
 	// Disable ticking for the component to save some CPU cycles
 	PrimaryComponentTick.bCanEverTick = false;
@@ -32,7 +42,8 @@ FPrimitiveSceneProxy* UTerrainComponent::CreateSceneProxy()
 	FPrimitiveSceneProxy* proxy = nullptr;
 	VerifyMapProxy();
 
-	if (Vertices.Num() > 0 && IndexBuffer.Num() > 0 && MapProxy.IsValid())
+	// Components the terrain has streamed out have no proxy, distant terrain is left to the far field if there is one
+	if (Size > 1 && MapProxy.IsValid() && StreamedIn)
 	{
 		proxy = new FTerrainComponentSceneProxy(this);
 	}
@@ -44,7 +55,25 @@ UBodySetup* UTerrainComponent::GetBodySetup()
 {
 	if (BodySetup == nullptr)
 	{
+		// Collision is not saved with the component, so after loading it is cooked when physics is first created
+		// With async cooking the physics state is recreated once the cook finishes
+		if (!IsTemplate() && AsyncCooking)
+		{
+			if (BodySetupQueue.Num() == 0)
+			{
+				CookCollisionAsync();
+			}
+			return nullptr;
+		}
+
 		BodySetup = CreateBodySetup();
+
+		// Otherwise the body is cooked before it is returned, so the component has collision as soon as it has physics
+		if (!IsTemplate())
+		{
+			BodySetup->bHasCookedCollisionData = true;
+			BodySetup->CreatePhysicsMeshes();
+		}
 	}
 	return BodySetup;
 }
@@ -54,17 +83,44 @@ int32 UTerrainComponent::GetNumMaterials() const
 	return 1;
 }
 
+void UTerrainComponent::GetResourceSizeEx(FResourceSizeEx& CumulativeResourceSize)
+{
+	Super::GetResourceSizeEx(CumulativeResourceSize);
+
+	// The map section is shared with the proxy, which only reads from it
+	if (MapProxy.IsValid())
+	{
+		CumulativeResourceSize.AddDedicatedSystemMemoryBytes(sizeof(FMapSection) + MapProxy->Data.GetAllocatedSize());
+	}
+
+	// The proxy's vertex buffers and adaptive index buffers as they were allocated, shared index buffers are counted by the terrain
+	CumulativeResourceSize.AddDedicatedVideoMemoryBytes(VideoMemory->GetValue());
+
+	// The collision body is built for this component alone
+	if (BodySetup != nullptr)
+	{
+		BodySetup->GetResourceSizeEx(CumulativeResourceSize);
+	}
+}
+
 bool UTerrainComponent::GetPhysicsTriMeshData(struct FTriMeshCollisionData* CollisionData, bool InUseAllTriData)
 {
+	if (Size < 2)
+	{
+		return false;
+	}
+
 	// Copy vertex and triangle data
-	CollisionData->Vertices = Vertices;
-	int32 num_triangles = IndexBuffer.Num() / 3;
+	GetCollisionVertices(CollisionData->Vertices);
+	const TArray<uint32>& indices = GetMeshTemplate()->LODIndices[0];
+	int32 num_triangles = indices.Num() / 3;
+	CollisionData->Indices.Reserve(num_triangles);
 	for (int32 i = 0; i < num_triangles; ++i)
 	{
 		FTriIndices tris;
-		tris.v0 = IndexBuffer[i * 3];
-		tris.v1 = IndexBuffer[i * 3 + 1];
-		tris.v2 = IndexBuffer[i * 3 + 2];
+		tris.v0 = indices[i * 3];
+		tris.v1 = indices[i * 3 + 1];
+		tris.v2 = indices[i * 3 + 2];
 		CollisionData->Indices.Add(tris);
 	}
 
@@ -79,9 +135,11 @@ FBoxSphereBounds UTerrainComponent::CalcBounds(const FTransform& LocalToWorld) c
 {
 	FBox bound(ForceInit);
 
-	for (int32 i = 0; i < Vertices.Num(); ++i)
+	if (MapProxy.IsValid() && Size > 1)
 	{
-		bound += LocalToWorld.TransformPosition(Vertices[i]);
+		// The section tracks its height range when it is copied from the heightmap, so only the box corners need transforming
+		uint32 width = GetTerrainComponentWidth(Size);
+		bound = FBox(FVector(0.0f, 0.0f, MapProxy->MinHeight), FVector(width - 1, width - 1, MapProxy->MaxHeight)).TransformBy(LocalToWorld);
 	}
 
 	FBoxSphereBounds boxsphere;
@@ -96,57 +154,70 @@ FBoxSphereBounds UTerrainComponent::CalcBounds(const FTransform& LocalToWorld) c
 
 void UTerrainComponent::Initialize(ATerrain* Terrain, TSharedPtr<FMapSection, ESPMode::ThreadSafe> Proxy, int32 X, int32 Y)
 {
+	uint32 old_lods = LODs;
+	float old_scale = LODScale;
+	uint32 old_size = Size;
+	FIntPoint old_offset(XOffset, YOffset);
+	FIntPoint old_count = ComponentCount;
+
 	XOffset = X;
 	YOffset = Y;
+	ComponentCount = FIntPoint(Terrain->GetXWidth(), Terrain->GetYWidth());
 	LODs = Terrain->GetNumLODs();
 	LODScale = Terrain->GetLODDistanceScale();
+	LODErrorThreshold = Terrain->GetLODErrorThreshold();
+	ShadowLODBias = Terrain->GetShadowLODBias();
+	SetAdaptiveTriangulation(Terrain->GetAdaptiveTriangulation(), Terrain->GetAdaptiveErrorThreshold());
 	Tiling = Terrain->GetTiling();
 	AsyncCooking = Terrain->GetAsyncCookingEnabled();
 	MapProxy = Proxy;
 
+	// Stitched edges and static batches are chosen when the proxy is created, so a pooled component moved within the grid needs a new one
+	if (LODs != old_lods || LODScale != old_scale || FIntPoint(X, Y) != old_offset || ComponentCount != old_count)
+	{
+		MarkRenderStateDirty();
+	}
 	SetMaterial(0, Terrain->GetMaterials());
 	SetSize(Terrain->GetComponentSize());
-}
 
-void UTerrainComponent::CreateMeshData()
-{
-	// Create vertex data
-	uint32 width = GetTerrainComponentWidth(Size);
-	Vertices.Empty();
-	Vertices.SetNumUninitialized(width * width);
-	for (uint32 y = 0; y < width; ++y)
+	// A component reused from a previous layout with the same size can update its existing proxy and collision in place
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
 	{
-		for (uint32 x = 0; x < width; ++x)
-		{
-			Vertices[y * width + x] = FVector(x, y, 0.0f);
-		}
+		Update(Proxy);
+		SetTiling(Tiling);
 	}
-
-	// Create triangles
-	uint32 polygons = width - 1;
-	IndexBuffer.Empty();
-	IndexBuffer.SetNumUninitialized(polygons * polygons * 6);
-	for (uint32 y = 0; y < polygons; ++y)
+	else if (Size == old_size)
 	{
-		for (uint32 x = 0; x < polygons; ++x)
-		{
-			uint32 i = (y * polygons + x) * 6;
+		// Without a proxy to update, the new heights still have to reach physics, a changed size has already recooked collision
+		// Any update still running was built from the old section, and the next proxy is created from the new one
+		UpdateVersion->Increment();
+		UpdateBounds();
+		UpdateCollision();
+	}
+}
 
-			IndexBuffer[i] = x + (y * width);
-			IndexBuffer[i + 1] = 1 + x + (y + 1) * width;
-			IndexBuffer[i + 2] = 1 + x + y * width;
+void UTerrainComponent::CreateMeshData()
+{
+	MeshTemplate = FTerrainMeshTemplate::Get(Size);
+}
 
-			IndexBuffer[i + 3] = x + (y * width);
-			IndexBuffer[i + 4] = x + (y + 1) * width;
-			IndexBuffer[i + 5] = 1 + x + (y + 1) * width;
-		}
+TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> UTerrainComponent::GetMeshTemplate()
+{
+	// The template is not saved with the component, so it may need to be acquired after loading
+	if (!MeshTemplate.IsValid() || MeshTemplate->Size != Size)
+	{
+		CreateMeshData();
 	}
+	return MeshTemplate.ToSharedRef();
 }
 
 void UTerrainComponent::SetSize(uint32 NewSize)
 {
 	if (NewSize > 1 && NewSize != Size)
 	{
+		// Vertex data being built for the old size is no longer useful
+		UpdateVersion->Increment();
+
 		Size = NewSize;
 		CreateMeshData();
 		UpdateCollision();
@@ -159,17 +230,36 @@ uint32 UTerrainComponent::GetSize()
 	return Size;
 }
 
+void UTerrainComponent::SetStreamedIn(bool NewStreamedIn)
+{
+	if (StreamedIn != NewStreamedIn)
+	{
+		// The proxy is created from the current map section, so nothing is lost while it is released
+		StreamedIn = NewStreamedIn;
+		MarkRenderStateDirty();
+	}
+}
+
+bool UTerrainComponent::IsStreamedIn() const
+{
+	return StreamedIn;
+}
+
 void UTerrainComponent::SetTiling(float NewTiling)
 {
 	Tiling = NewTiling;
 	float x = XOffset;
 	float y = YOffset;
 
-	// Update UV data in the proxy
-	FTerrainComponentSceneProxy* proxy = (FTerrainComponentSceneProxy*)SceneProxy;
-	ENQUEUE_RENDER_COMMAND(FComponentUpdate)([proxy, x, y, NewTiling](FRHICommandListImmediate& RHICmdList) {
-		proxy->UpdateUVs(x, y, NewTiling);
-		});
+	// Update UV data in the proxy, a streamed out component or one hidden while the quadtree draws has none
+	// Its next proxy is created with the stored tiling
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainComponentSceneProxy* proxy = (FTerrainComponentSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FComponentUpdate)([proxy, x, y, NewTiling](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateUVs(x, y, NewTiling);
+			});
+	}
 }
 
 void UTerrainComponent::SetLODs(int32 NumLODs, float DistanceScale)
@@ -188,28 +278,115 @@ void UTerrainComponent::SetLODs(int32 NumLODs, float DistanceScale)
 	MarkRenderStateDirty();
 }
 
+void UTerrainComponent::SetLODErrorThreshold(float Pixels)
+{
+	LODErrorThreshold = Pixels;
+
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainComponentSceneProxy* proxy = (FTerrainComponentSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FComponentUpdate)([proxy, Pixels](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateLODErrorThreshold(Pixels);
+			});
+	}
+}
+
+void UTerrainComponent::SetShadowLODBias(int32 Bias)
+{
+	ShadowLODBias = Bias;
+
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainComponentSceneProxy* proxy = (FTerrainComponentSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FComponentUpdate)([proxy, Bias](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateShadowLODBias(Bias);
+			});
+	}
+}
+
+void UTerrainComponent::SetAdaptiveTriangulation(bool Enable, float ErrorThreshold)
+{
+	if (Enable == AdaptiveTriangulation && ErrorThreshold == AdaptiveErrorThreshold)
+	{
+		return;
+	}
+
+	AdaptiveTriangulation = Enable;
+	AdaptiveErrorThreshold = ErrorThreshold;
+
+	// Reset the proxy to switch index buffers
+	MarkRenderStateDirty();
+}
+
 void UTerrainComponent::Update(TSharedPtr<FMapSection, ESPMode::ThreadSafe> NewSection)
 {
 	MapProxy = NewSection;
+	UpdateBounds();
 
-	// Update collision data and bounds
-	uint32 width = GetTerrainComponentWidth(Size);
-	for (uint32 y = 0; y < width; ++y)
+	// Starting a new job supersedes any job still running for an older section
+	int32 version = UpdateVersion->Increment();
+	if (Size < 2 || !NewSection.IsValid())
 	{
-		for (uint32 x = 0; x < width; ++x)
+		return;
+	}
+
+	// Build vertex data on a worker thread, then upload it and update collision on the game thread
+	TWeakObjectPtr<UTerrainComponent> component(this);
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> latest = UpdateVersion;
+	TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> mesh_template = GetMeshTemplate();
+	uint32 width = GetTerrainComponentWidth(Size);
+	bool adaptive = AdaptiveTriangulation;
+	float adaptive_threshold = AdaptiveErrorThreshold;
+	Async(EAsyncExecution::ThreadPool, [component, latest, version, NewSection, mesh_template, width, adaptive, adaptive_threshold]() {
+		if (latest->GetValue() != version)
 		{
-			Vertices[y * width + x].Z = MapProxy->Data[(y + 1) * NewSection->X + x + 1];
+			return;
 		}
-	}
-	BodyInstance.UpdateTriMeshVertices(Vertices);
-	UpdateBounds();
 
-	// Update the scene proxy
-	FTerrainComponentSceneProxy* proxy = (FTerrainComponentSceneProxy*)SceneProxy;
-	ENQUEUE_RENDER_COMMAND(FComponentUpdate)([proxy, NewSection](FRHICommandListImmediate& RHICmdList) {
-		proxy->UpdateMap(NewSection);
+		TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> data = MakeShareable(new FTerrainVertexData());
+		data->Heights.SetNumUninitialized(width * width);
+		data->Normals.SetNumUninitialized(width * width);
+		data->MorphHeights.SetNumUninitialized(width * width);
+		FTerrainComponentSceneProxy::BuildVertices(*NewSection, *mesh_template, data->Heights.GetData(), data->Normals.GetData(), data->MorphHeights.GetData());
+		mesh_template->GetLODErrors(data->Heights.GetData(), width, data->LODErrors);
+		if (adaptive)
+		{
+			FTerrainComponentSceneProxy::BuildAdaptiveIndices(*mesh_template, data->Heights.GetData(), width, data->LODErrors, adaptive_threshold, data->AdaptiveIndices);
+		}
+
+		AsyncTask(ENamedThreads::GameThread, [component, version, data]() {
+			if (component.IsValid())
+			{
+				component->FinishUpdate(version, data);
+			}
+			});
 		});
-	MarkRenderTransformDirty();
+}
+
+void UTerrainComponent::FinishUpdate(int32 Version, TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData)
+{
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_FinishUpdate);
+
+	// Discard the results of jobs that were superseded while they were running
+	if (Version != UpdateVersion->GetValue())
+	{
+		return;
+	}
+
+	// Upload the vertex data, unless the proxy is about to be recreated from the current section anyway
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainComponentSceneProxy* proxy = (FTerrainComponentSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FComponentUpdate)([proxy, VertexData](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateVertexData(VertexData);
+			});
+		MarkRenderTransformDirty();
+	}
+
+	// Update collision data
+	TArray<FVector> vertices;
+	GetCollisionVertices(vertices);
+	BodyInstance.UpdateTriMeshVertices(vertices);
 }
 
 void UTerrainComponent::UpdateCollision()
@@ -218,21 +395,16 @@ void UTerrainComponent::UpdateCollision()
 
 	if (AsyncCooking)
 	{
-		// Abort previous cooks
-		for (UBodySetup* body : BodySetupQueue)
-		{
-			body->AbortPhysicsMeshAsyncCreation();
-		}
-
-		// Start cooking a new body
-		BodySetupQueue.Add(CreateBodySetup());
-		BodySetupQueue.Last()->CreatePhysicsMeshesAsync(FOnAsyncPhysicsCookFinished::CreateUObject(this, &UTerrainComponent::FinishCollision, BodySetupQueue.Last()));
+		CookCollisionAsync();
 	}
 	else
 	{
 		// Create a new body setup and clean out the async queue
 		BodySetupQueue.Empty();
-		GetBodySetup();
+		if (BodySetup == nullptr)
+		{
+			BodySetup = CreateBodySetup();
+		}
 
 		// Change GUID for new collision data
 		BodySetup->BodySetupGuid = FGuid::NewGuid();
@@ -245,6 +417,19 @@ void UTerrainComponent::UpdateCollision()
 	}
 }
 
+void UTerrainComponent::CookCollisionAsync()
+{
+	// Abort previous cooks
+	for (UBodySetup* body : BodySetupQueue)
+	{
+		body->AbortPhysicsMeshAsyncCreation();
+	}
+
+	// Start cooking a new body
+	BodySetupQueue.Add(CreateBodySetup());
+	BodySetupQueue.Last()->CreatePhysicsMeshesAsync(FOnAsyncPhysicsCookFinished::CreateUObject(this, &UTerrainComponent::FinishCollision, BodySetupQueue.Last()));
+}
+
 void UTerrainComponent::FinishCollision(bool Success, UBodySetup* NewBodySetup)
 {
 	// Create a new queue for async cooking
@@ -288,6 +473,25 @@ UBodySetup* UTerrainComponent::CreateBodySetup()
 	return newbody;
 }
 
+void UTerrainComponent::GetCollisionVertices(TArray<FVector>& OutVertices) const
+{
+	OutVertices.Empty();
+	if (!MapProxy.IsValid() || Size < 2)
+	{
+		return;
+	}
+
+	uint32 width = GetTerrainComponentWidth(Size);
+	OutVertices.SetNumUninitialized(width * width);
+	for (uint32 y = 0; y < width; ++y)
+	{
+		for (uint32 x = 0; x < width; ++x)
+		{
+			OutVertices[y * width + x] = FVector(x, y, MapProxy->Data[(y + 1) * MapProxy->X + x + 1]);
+		}
+	}
+}
+
 TSharedPtr<FMapSection, ESPMode::ThreadSafe> UTerrainComponent::GetMapProxy()
 {
 	VerifyMapProxy();
@@ -0,0 +1,294 @@
+#include "TerrainFarFieldComponent.h"
+
+#include "Terrain.h"
+#include "TerrainRender.h"
+#include "TerrainFarFieldRender.h"
+#include "TerrainStat.h"
+
+#include "Engine.h"
+#include "Materials/Material.h"
+#include "Async/ParallelFor.h"
+
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Build Far Field"), STAT_DynamicTerrain_BuildFarField, STATGROUP_DynamicTerrain);
+
+/// Mesh Component Interface ///
+
+UTerrainFarFieldComponent::UTerrainFarFieldComponent(const FObjectInitializer& ObjectInitializer)
+{
+	Size = 0;
+	ComponentCount = FIntPoint::ZeroValue;
+	Resolution = 4;
+	ComponentLODs = 1;
+	Distance = 0.0f;
+	Tiling = 1.0f;
+	Map = nullptr;
+
+	// Disable ticking for the component to save some CPU cycles
+	PrimaryComponentTick.bCanEverTick = false;
+
+	// Collision is provided by the terrain's components
+	SetCollisionEnabled(ECollisionEnabled::NoCollision);
+}
+
+FPrimitiveSceneProxy* UTerrainFarFieldComponent::CreateSceneProxy()
+{
+	FPrimitiveSceneProxy* proxy = nullptr;
+
+	// The mesh is not saved with the component, it is rebuilt by the terrain after loading
+	if (Size > 1 && VertexData.IsValid())
+	{
+		proxy = new FTerrainFarFieldSceneProxy(this);
+	}
+
+	return proxy;
+}
+
+int32 UTerrainFarFieldComponent::GetNumMaterials() const
+{
+	return 1;
+}
+
+void UTerrainFarFieldComponent::GetResourceSizeEx(FResourceSizeEx& CumulativeResourceSize)
+{
+	Super::GetResourceSizeEx(CumulativeResourceSize);
+
+	// The vertex data is kept so that edits only rebuild the patches they touch, the proxy has a GPU copy of it
+	CumulativeResourceSize.AddDedicatedSystemMemoryBytes(PatchDepths.GetAllocatedSize());
+	if (VertexData.IsValid())
+	{
+		uint32 vertex_bytes = VertexData->Heights.GetAllocatedSize() + VertexData->Normals.GetAllocatedSize() + VertexData->MorphHeights.GetAllocatedSize();
+		CumulativeResourceSize.AddDedicatedSystemMemoryBytes(vertex_bytes);
+		if (SceneProxy != nullptr)
+		{
+			CumulativeResourceSize.AddDedicatedVideoMemoryBytes(vertex_bytes);
+		}
+	}
+}
+
+FBoxSphereBounds UTerrainFarFieldComponent::CalcBounds(const FTransform& LocalToWorld) const
+{
+	FBox bound(ForceInit);
+
+	if (VertexData.IsValid() && VertexData->Heights.Num() > 0 && Size > 1)
+	{
+		float min_height = MAX_flt;
+		float max_height = -MAX_flt;
+		for (float height : VertexData->Heights)
+		{
+			min_height = FMath::Min(min_height, height);
+			max_height = FMath::Max(max_height, height);
+		}
+
+		uint32 polygons = GetTerrainComponentWidth(Size) - 1;
+		bound = FBox(FVector(0.0f, 0.0f, min_height), FVector(ComponentCount.X * polygons, ComponentCount.Y * polygons, max_height)).TransformBy(LocalToWorld);
+	}
+
+	FBoxSphereBounds boxsphere;
+	boxsphere.BoxExtent = bound.GetExtent();
+	boxsphere.Origin = bound.GetCenter();
+	boxsphere.SphereRadius = boxsphere.BoxExtent.Size();
+
+	return boxsphere;
+}
+
+/// Terrain Interface ///
+
+void UTerrainFarFieldComponent::Initialize(ATerrain* Terrain)
+{
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_BuildFarField);
+
+	Size = Terrain->GetComponentSize();
+	ComponentCount = FIntPoint(Terrain->GetXWidth(), Terrain->GetYWidth());
+	ComponentLODs = Terrain->GetNumLODs();
+	Distance = Terrain->GetFarFieldDistance();
+	Tiling = Terrain->GetTiling();
+	Map = Terrain->GetMap();
+	MeshTemplate = FTerrainMeshTemplate::Get(Size);
+	SetMaterial(0, Terrain->GetMaterials());
+
+	// Patches use a power of two resolution so that they match one of the component LODs
+	int32 polygons = GetTerrainComponentWidth(Size) - 1;
+	Resolution = FMath::Clamp<int32>(FMath::RoundUpToPowerOfTwo(FMath::Max(Terrain->GetFarFieldResolution(), 1)), 2, polygons);
+
+	// Every vertex needs the depth of the patches around it, so the depths are found first
+	PatchDepths.SetNumZeroed(ComponentCount.X * ComponentCount.Y);
+	ParallelFor(PatchDepths.Num(), [&](int32 i) {
+		BuildPatchDepth(i);
+		});
+
+	int32 vertex_width = GetVertexWidth();
+	int32 vertex_height = ComponentCount.Y * Resolution + 1;
+	TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> data = MakeShareable(new FTerrainVertexData());
+	data->Heights.SetNumUninitialized(vertex_width * vertex_height);
+	data->Normals.SetNumUninitialized(vertex_width * vertex_height);
+	data->MorphHeights.SetNumUninitialized(vertex_width * vertex_height);
+	BuildVertices(*data, FIntRect(0, 0, vertex_width - 1, vertex_height - 1));
+	VertexData = data;
+
+	UpdateBounds();
+	MarkRenderStateDirty();
+}
+
+void UTerrainFarFieldComponent::UpdateComponents(const TArray<int32>& Components)
+{
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_BuildFarField);
+
+	if (!VertexData.IsValid() || Map == nullptr)
+	{
+		return;
+	}
+
+	ParallelFor(Components.Num(), [&](int32 i) {
+		BuildPatchDepth(Components[i]);
+		});
+
+	// The vertex data is only copied while a proxy that hasn't finished initializing still holds it
+	if (!VertexData.IsUnique())
+	{
+		VertexData = MakeShareable(new FTerrainVertexData(*VertexData));
+	}
+
+	// Only the vertices of the changed patches are rebuilt, plus one vertex around them for normals and shared depths
+	int32 vertex_width = GetVertexWidth();
+	FIntRect limits(0, 0, vertex_width - 1, ComponentCount.Y * Resolution);
+	TArray<FIntPoint> spans;
+	for (int32 component : Components)
+	{
+		FIntPoint patch(component % ComponentCount.X, component / ComponentCount.X);
+		FIntRect region(patch * Resolution - FIntPoint(1, 1), (patch + FIntPoint(1, 1)) * Resolution + FIntPoint(1, 1));
+		region.Clip(limits);
+		BuildVertices(*VertexData, region);
+		spans.Add(FIntPoint(region.Min.Y, region.Max.Y));
+	}
+
+	// Send the rows of the changed patches to the proxy, merging the spans of rows that touch
+	if (SceneProxy != nullptr && !IsRenderStateDirty() && spans.Num() > 0)
+	{
+		spans.Sort([](const FIntPoint& A, const FIntPoint& B) {
+			return A.X < B.X;
+			});
+
+		TArray<int32> first_rows;
+		TArray<TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe>> rows;
+		for (int32 i = 0; i < spans.Num(); ++i)
+		{
+			FIntPoint span = spans[i];
+			while (i + 1 < spans.Num() && spans[i + 1].X <= span.Y + 1)
+			{
+				span.Y = FMath::Max(span.Y, spans[++i].Y);
+			}
+
+			int32 first = span.X * vertex_width;
+			int32 count = (span.Y - span.X + 1) * vertex_width;
+			TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> data = MakeShareable(new FTerrainVertexData());
+			data->Heights.Append(VertexData->Heights.GetData() + first, count);
+			data->Normals.Append(VertexData->Normals.GetData() + first, count);
+			data->MorphHeights.Append(VertexData->MorphHeights.GetData() + first, count);
+			first_rows.Add(span.X);
+			rows.Add(data);
+		}
+
+		FTerrainFarFieldSceneProxy* proxy = (FTerrainFarFieldSceneProxy*)SceneProxy;
+		TArray<int32> patches = Components;
+		ENQUEUE_RENDER_COMMAND(FFarFieldUpdate)([proxy, first_rows, rows, patches](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateVertexRows(first_rows, rows, patches);
+			});
+	}
+
+	UpdateBounds();
+	MarkRenderTransformDirty();
+}
+
+void UTerrainFarFieldComponent::SetDistance(float NewDistance)
+{
+	Distance = NewDistance;
+
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainFarFieldSceneProxy* proxy = (FTerrainFarFieldSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FFarFieldUpdate)([proxy, NewDistance](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateDistance(NewDistance);
+			});
+	}
+}
+
+void UTerrainFarFieldComponent::SetTiling(float NewTiling)
+{
+	Tiling = NewTiling;
+
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainFarFieldSceneProxy* proxy = (FTerrainFarFieldSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FFarFieldUpdate)([proxy, NewTiling](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateTiling(NewTiling);
+			});
+	}
+}
+
+/// Mesh Generation ///
+
+void UTerrainFarFieldComponent::BuildPatchDepth(int32 Patch)
+{
+	// Copy the component's full resolution grid from the heightmap
+	int32 width = MeshTemplate->Width;
+	FIntPoint origin = FIntPoint(Patch % ComponentCount.X, Patch / ComponentCount.X) * (width - 1) + FIntPoint(1, 1);
+	TArray<float> heights;
+	heights.SetNumUninitialized(width * width);
+	for (int32 y = 0; y < width; ++y)
+	{
+		for (int32 x = 0; x < width; ++x)
+		{
+			heights[y * width + x] = Map->GetHeight(origin.X + x, origin.Y + y);
+		}
+	}
+
+	TArray<float> errors;
+	MeshTemplate->GetLODErrors(heights.GetData(), width, errors);
+
+	// The patch has the same triangles as one of the component's LODs, and the component may be drawn at up to its coarsest LOD
+	// Sinking by both errors keeps the patch below the component wherever they overlap
+	int32 patch_lod = FMath::Clamp<int32>(Size - FMath::FloorLog2(Resolution), 0, errors.Num() - 1);
+	int32 component_lod = FMath::Clamp(ComponentLODs - 1, 0, errors.Num() - 1);
+	PatchDepths[Patch] = errors[patch_lod] + errors[component_lod];
+}
+
+void UTerrainFarFieldComponent::BuildVertices(FTerrainVertexData& Data, FIntRect Region) const
+{
+	int32 stride = (MeshTemplate->Width - 1) / Resolution;
+	int32 vertex_width = GetVertexWidth();
+	int32 max_x = Map->GetWidthX() - 1;
+	int32 max_y = Map->GetWidthY() - 1;
+	int32 last_patch_x = ComponentCount.X * Resolution - 1;
+	int32 last_patch_y = ComponentCount.Y * Resolution - 1;
+
+	for (int32 y = Region.Min.Y; y <= Region.Max.Y; ++y)
+	{
+		for (int32 x = Region.Min.X; x <= Region.Max.X; ++x)
+		{
+			// Sample the heightmap past its border, the same way the components do
+			int32 map_x = 1 + x * stride;
+			int32 map_y = 1 + y * stride;
+			float height = Map->GetHeight(map_x, map_y);
+			float s01 = Map->GetHeight(FMath::Max(map_x - stride, 0), map_y);
+			float s21 = Map->GetHeight(FMath::Min(map_x + stride, max_x), map_y);
+			float s10 = Map->GetHeight(map_x, FMath::Max(map_y - stride, 0));
+			float s12 = Map->GetHeight(map_x, FMath::Min(map_y + stride, max_y));
+
+			// Sink the vertex by the largest depth of the patches that share it
+			float depth = 0.0f;
+			for (int32 py = FMath::Max(y - 1, 0) / Resolution; py <= FMath::Min(y, last_patch_y) / Resolution; ++py)
+			{
+				for (int32 px = FMath::Max(x - 1, 0) / Resolution; px <= FMath::Min(x, last_patch_x) / Resolution; ++px)
+				{
+					depth = FMath::Max(depth, PatchDepths[py * ComponentCount.X + px]);
+				}
+			}
+
+			// Nothing morphs in the far field, so the morph heights match the heights
+			int32 i = y * vertex_width + x;
+			Data.Heights[i] = height - depth;
+			Data.MorphHeights[i] = height - depth;
+			Data.Normals[i] = FTerrainNormalVertex(FVector(s01 - s21, s10 - s12, 2.0f * stride));
+		}
+	}
+}
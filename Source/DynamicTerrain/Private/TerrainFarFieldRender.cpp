@@ -0,0 +1,368 @@
+#include "TerrainFarFieldRender.h"
+#include "TerrainFarFieldComponent.h"
+#include "TerrainRender.h"
+#include "Terrain.h"
+#include "TerrainStat.h"
+
+#include "Engine.h"
+#include "SceneView.h"
+#include "Materials/Material.h"
+
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Select Far Field Patches"), STAT_DynamicTerrain_SelectPatches, STATGROUP_DynamicTerrain);
+
+/// Scene Proxy ///
+
+FTerrainFarFieldSceneProxy::FTerrainFarFieldSceneProxy(UTerrainFarFieldComponent* Component) : FPrimitiveSceneProxy(Component), VertexFactory(GetScene().GetFeatureLevel()), MaterialRelevance(Component->GetMaterialRelevance(GetScene().GetFeatureLevel()))
+{
+	// Get the layout of the mesh from the component
+	ComponentCount = Component->ComponentCount;
+	Resolution = Component->Resolution;
+	ComponentPolygons = GetTerrainComponentWidth(Component->Size) - 1;
+	Distance = Component->Distance;
+
+	// Get the material from the parent or use the engine default
+	// Terrain shaders are only compiled for materials used with landscapes, the editor sets the flag the first time it is checked
+	Material = Component->GetMaterial(0);
+	if (Material == nullptr || !Material->CheckMaterialUsage_Concurrent(MATUSAGE_Landscape))
+	{
+		Material = UMaterial::GetDefaultMaterial(MD_Surface);
+	}
+
+	// Initialize the mesh on the rendering thread
+	TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> data = Component->VertexData;
+	float tiling = Component->Tiling;
+	ENQUEUE_RENDER_COMMAND(FFarFieldFillBuffers)([this, data, tiling](FRHICommandListImmediate& RHICmdList) {
+		Initialize(data, tiling);
+		});
+}
+
+FTerrainFarFieldSceneProxy::~FTerrainFarFieldSceneProxy()
+{
+	HeightVertexBuffer.ReleaseResource();
+	NormalVertexBuffer.ReleaseResource();
+	MorphVertexBuffer.ReleaseResource();
+	IndexBuffer.ReleaseResource();
+	VertexFactory.ReleaseResource();
+	LODUniformBuffer.SafeRelease();
+}
+
+/// Scene Proxy Interface ///
+
+void FTerrainFarFieldSceneProxy::GetDynamicMeshElements(const TArray< const FSceneView* >& Views, const FSceneViewFamily& ViewFamily, uint32 VisibilityMap, class FMeshElementCollector& Collector) const
+{
+	// Check to see if wireframe rendering is enabled
+	const bool wireframe = AllowDebugViewmodes() && ViewFamily.EngineShowFlags.Wireframe;
+
+	// Get the material proxy from either the current material or the wireframe material
+	FMaterialRenderProxy* material_proxy = nullptr;
+	if (wireframe)
+	{
+		// Get the wireframe material
+		FColoredMaterialRenderProxy* wireframe_material = new FColoredMaterialRenderProxy(GEngine->WireframeMaterial ? GEngine->WireframeMaterial->GetRenderProxy() : nullptr, FLinearColor(0.0f, 0.5f, 1.0f));
+		Collector.RegisterOneFrameMaterialProxy(wireframe_material);
+
+		material_proxy = wireframe_material;
+	}
+	else
+	{
+		material_proxy = Material->GetRenderProxy();
+	}
+
+	int32 patch_indices = Resolution * Resolution * 6;
+	for (int32 view_index = 0; view_index < Views.Num(); ++view_index)
+	{
+		if (VisibilityMap & (1 << view_index))
+		{
+			const FSceneView* view = Views[view_index];
+
+			// Find the patches whose components are culled for the view
+			TArray<FIntPoint> ranges;
+			SelectPatches(GetLODView(*view), ranges);
+			if (ranges.Num() == 0)
+			{
+				continue;
+			}
+
+			// Load uniform buffers
+			bool bHasPrecomputedVolumetricLightmap;
+			FMatrix PreviousLocalToWorld;
+			int32 SingleCaptureIndex;
+			bool bOutputVelocity;
+			GetScene().GetPrimitiveUniformShaderParameters_RenderThread(GetPrimitiveSceneInfo(), bHasPrecomputedVolumetricLightmap, PreviousLocalToWorld, SingleCaptureIndex, bOutputVelocity);
+
+			FDynamicPrimitiveUniformBuffer& DynamicPrimitiveUniformBuffer = Collector.AllocateOneFrameResource<FDynamicPrimitiveUniformBuffer>();
+			DynamicPrimitiveUniformBuffer.Set(GetLocalToWorld(), PreviousLocalToWorld, GetBounds(), GetLocalBounds(), true, bHasPrecomputedVolumetricLightmap, DrawsVelocity(), bOutputVelocity);
+
+			// Set up the mesh
+			FMeshBatch& mesh = Collector.AllocateMesh();
+			mesh.VertexFactory = &VertexFactory;
+			mesh.MaterialRenderProxy = material_proxy;
+			mesh.ReverseCulling = IsLocalToWorldDeterminantNegative();
+			mesh.Type = PT_TriangleList;
+			mesh.DepthPriorityGroup = SDPG_World;
+			mesh.bCanApplyViewModeOverrides = false;
+			mesh.bWireframe = wireframe;
+			mesh.CastShadow = true;
+
+			// Each range of patches is one element of the mesh
+			for (int32 i = 0; i < ranges.Num(); ++i)
+			{
+				if (i > 0)
+				{
+					mesh.Elements.AddDefaulted();
+				}
+
+				FMeshBatchElement& element = mesh.Elements[i];
+				element.IndexBuffer = &IndexBuffer;
+				element.FirstIndex = ranges[i].X * patch_indices;
+				element.NumPrimitives = ranges[i].Y * patch_indices / 3;
+				element.MinVertexIndex = 0;
+				element.MaxVertexIndex = HeightVertexBuffer.GetNumVertices() - 1;
+				element.UserData = &LODUniformBuffer;
+				element.PrimitiveUniformBufferResource = &DynamicPrimitiveUniformBuffer.UniformBuffer;
+			}
+
+			// Add the mesh
+			Collector.AddMesh(view_index, mesh);
+		}
+	}
+
+	// Draw bounds in debug builds
+#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+	for (int32 view_index = 0; view_index < Views.Num(); ++view_index)
+	{
+		if (VisibilityMap & (1 << view_index))
+		{
+			// Render the object bounds
+			RenderBounds(Collector.GetPDI(view_index), ViewFamily.EngineShowFlags, GetBounds(), IsSelected());
+		}
+	}
+#endif
+}
+
+FPrimitiveViewRelevance FTerrainFarFieldSceneProxy::GetViewRelevance(const FSceneView* View) const
+{
+	FPrimitiveViewRelevance Result;
+	Result.bDrawRelevance = IsShown(View);
+	Result.bShadowRelevance = IsShadowCast(View);
+
+	// The patches drawn change with every view, so the far field is always drawn dynamically
+	Result.bDynamicRelevance = true;
+	Result.bStaticRelevance = false;
+
+	Result.bRenderInMainPass = ShouldRenderInMainPass();
+	Result.bUsesLightingChannels = GetLightingChannelMask() != GetDefaultLightingChannelMask();
+	Result.bRenderCustomDepth = ShouldRenderCustomDepth();
+
+	Result.bTranslucentSelfShadow = bCastVolumetricTranslucentShadow;
+	MaterialRelevance.SetPrimitiveViewRelevance(Result);
+	Result.bVelocityRelevance = IsMovable() && Result.bOpaque && Result.bRenderInMainPass;
+	return Result;
+}
+
+/// Proxy Update Functions ///
+
+void FTerrainFarFieldSceneProxy::UpdateVertexData(TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData)
+{
+	// Ignore data built for a different layout
+	if (VertexData->Heights.Num() != HeightVertexBuffer.GetNumVertices() || VertexData->Normals.Num() != NormalVertexBuffer.GetNumVertices() || VertexData->MorphHeights.Num() != MorphVertexBuffer.GetNumVertices())
+	{
+		return;
+	}
+
+	FMemory::Memcpy(HeightVertexBuffer.Lock(), VertexData->Heights.GetData(), HeightVertexBuffer.GetSize());
+	HeightVertexBuffer.Unlock();
+	FMemory::Memcpy(NormalVertexBuffer.Lock(), VertexData->Normals.GetData(), NormalVertexBuffer.GetSize());
+	NormalVertexBuffer.Unlock();
+	FMemory::Memcpy(MorphVertexBuffer.Lock(), VertexData->MorphHeights.GetData(), MorphVertexBuffer.GetSize());
+	MorphVertexBuffer.Unlock();
+
+	// Rebuild the bounds of each patch
+	PatchBounds.SetNum(ComponentCount.X * ComponentCount.Y);
+	for (int32 patch = 0; patch < PatchBounds.Num(); ++patch)
+	{
+		BuildPatchBounds(patch, VertexData->Heights, 0);
+	}
+}
+
+void FTerrainFarFieldSceneProxy::UpdateVertexRows(const TArray<int32>& FirstRows, const TArray<TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe>>& Rows, const TArray<int32>& Patches)
+{
+	// Ignore data built for a different layout
+	int32 vertex_width = ComponentCount.X * Resolution + 1;
+	int32 vertex_height = ComponentCount.Y * Resolution + 1;
+	if (vertex_width * vertex_height != HeightVertexBuffer.GetNumVertices())
+	{
+		return;
+	}
+
+	// Only the locked rows are written, the rest of each buffer keeps its contents
+	for (int32 i = 0; i < Rows.Num(); ++i)
+	{
+		const FTerrainVertexData& rows = *Rows[i];
+		int32 first = FirstRows[i] * vertex_width;
+		int32 count = rows.Heights.Num();
+		if (count % vertex_width != 0 || first + count > vertex_width * vertex_height)
+		{
+			return;
+		}
+
+		FMemory::Memcpy(HeightVertexBuffer.Lock(first, count), rows.Heights.GetData(), count * sizeof(float));
+		HeightVertexBuffer.Unlock();
+		FMemory::Memcpy(NormalVertexBuffer.Lock(first, count), rows.Normals.GetData(), count * sizeof(FTerrainNormalVertex));
+		NormalVertexBuffer.Unlock();
+		FMemory::Memcpy(MorphVertexBuffer.Lock(first, count), rows.MorphHeights.GetData(), count * sizeof(float));
+		MorphVertexBuffer.Unlock();
+	}
+
+	// Every changed patch lies inside one of the spans, along with its border
+	for (int32 patch : Patches)
+	{
+		int32 min_row = patch / ComponentCount.X * Resolution;
+		for (int32 i = 0; i < Rows.Num(); ++i)
+		{
+			int32 last_row = FirstRows[i] + Rows[i]->Heights.Num() / vertex_width - 1;
+			if (PatchBounds.IsValidIndex(patch) && FirstRows[i] <= min_row && min_row + Resolution <= last_row)
+			{
+				BuildPatchBounds(patch, Rows[i]->Heights, FirstRows[i]);
+				break;
+			}
+		}
+	}
+}
+
+void FTerrainFarFieldSceneProxy::BuildPatchBounds(int32 Patch, const TArray<float>& Heights, int32 FirstRow)
+{
+	int32 vertex_width = ComponentCount.X * Resolution + 1;
+	float spacing = (float)ComponentPolygons / Resolution;
+	FIntPoint origin = FIntPoint(Patch % ComponentCount.X, Patch / ComponentCount.X) * Resolution;
+	float min_height = MAX_flt;
+	float max_height = -MAX_flt;
+	for (int32 y = origin.Y; y <= origin.Y + Resolution; ++y)
+	{
+		for (int32 x = origin.X; x <= origin.X + Resolution; ++x)
+		{
+			float height = Heights[(y - FirstRow) * vertex_width + x];
+			min_height = FMath::Min(min_height, height);
+			max_height = FMath::Max(max_height, height);
+		}
+	}
+
+	FVector min(FVector2D(origin) * spacing, min_height);
+	FVector max(FVector2D(origin + FIntPoint(Resolution, Resolution)) * spacing, max_height);
+	PatchBounds[Patch] = FBox(min, max);
+}
+
+void FTerrainFarFieldSceneProxy::UpdateDistance(float NewDistance)
+{
+	Distance = NewDistance;
+}
+
+void FTerrainFarFieldSceneProxy::UpdateTiling(float Tiling)
+{
+	VertexFactory.SetUVParameters(FVector2D::ZeroVector, Tiling);
+}
+
+void FTerrainFarFieldSceneProxy::Initialize(TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData, float Tiling)
+{
+	int32 vertex_width = ComponentCount.X * Resolution + 1;
+	int32 vertex_height = ComponentCount.Y * Resolution + 1;
+
+	// Order the patches along a Morton curve, so patches that are close together are also close in the index buffer
+	PatchOrder.SetNum(ComponentCount.X * ComponentCount.Y);
+	for (int32 i = 0; i < PatchOrder.Num(); ++i)
+	{
+		PatchOrder[i] = i;
+	}
+	int32 count_x = ComponentCount.X;
+	PatchOrder.Sort([count_x](int32 A, int32 B) {
+		uint32 a = FMath::MortonCode2(A % count_x) | (FMath::MortonCode2(A / count_x) << 1);
+		uint32 b = FMath::MortonCode2(B % count_x) | (FMath::MortonCode2(B / count_x) << 1);
+		return a < b;
+		});
+
+	// Build the triangles of each patch, split the same way as the mesh template
+	TArray<uint32> indices;
+	indices.Reserve(PatchOrder.Num() * Resolution * Resolution * 6);
+	for (int32 patch : PatchOrder)
+	{
+		FIntPoint origin = FIntPoint(patch % ComponentCount.X, patch / ComponentCount.X) * Resolution;
+		for (int32 y = origin.Y; y < origin.Y + Resolution; ++y)
+		{
+			for (int32 x = origin.X; x < origin.X + Resolution; ++x)
+			{
+				indices.Add(x + y * vertex_width);
+				indices.Add((x + 1) + (y + 1) * vertex_width);
+				indices.Add((x + 1) + y * vertex_width);
+
+				indices.Add(x + y * vertex_width);
+				indices.Add(x + (y + 1) * vertex_width);
+				indices.Add((x + 1) + (y + 1) * vertex_width);
+			}
+		}
+	}
+	IndexBuffer.SetIndices(indices, vertex_width * vertex_height);
+	IndexBuffer.InitResource();
+
+	// Initialize the vertex buffers
+	HeightVertexBuffer.Init(vertex_width * vertex_height);
+	NormalVertexBuffer.Init(vertex_width * vertex_height);
+	MorphVertexBuffer.Init(vertex_width * vertex_height);
+	HeightVertexBuffer.InitResource();
+	NormalVertexBuffer.InitResource();
+	MorphVertexBuffer.InitResource();
+	UpdateVertexData(VertexData);
+
+	// No vertex has this level, so nothing morphs
+	FTerrainLODParameters parameters;
+	parameters.MorphParameters = FVector4(32.0f, 0.0f, 0.0f, 0.0f);
+	LODUniformBuffer = TUniformBufferRef<FTerrainLODParameters>::CreateUniformBufferImmediate(parameters, UniformBuffer_MultiFrame);
+
+	// Bind vertex factory data
+	FTerrainVertexFactory::FDataType datatype;
+	datatype.HeightComponent = FVertexStreamComponent(&HeightVertexBuffer, 0, sizeof(float), VET_Float1);
+	datatype.NormalComponent = FVertexStreamComponent(&NormalVertexBuffer, 0, sizeof(FTerrainNormalVertex), VET_Short2N);
+	datatype.MorphHeightComponent = FVertexStreamComponent(&MorphVertexBuffer, 0, sizeof(float), VET_Float1);
+
+	// Initalize the vertex factory, the grid covers the whole terrain
+	VertexFactory.SetData(datatype);
+	VertexFactory.SetGridParameters(vertex_width, (float)ComponentPolygons / Resolution);
+	VertexFactory.SetUVParameters(FVector2D::ZeroVector, Tiling);
+	VertexFactory.InitResource();
+}
+
+/// Patch Selection ///
+
+void FTerrainFarFieldSceneProxy::SelectPatches(const FSceneView& View, TArray<FIntPoint>& OutRanges) const
+{
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_SelectPatches);
+
+	// Components are culled by the distance from the view to the centre of their bounds, scaled by the view distance setting
+	// This is the same test the renderer uses for their max draw distance, so the view's LOD scale doesn't apply to it
+	FCachedSystemScalabilityCVars cvars = GetCachedScalabilityCVars();
+	float cutoff = Distance * cvars.ViewDistanceScale;
+	FVector view_origin = View.ViewMatrices.GetViewOrigin();
+	const FMatrix& local_to_world = GetLocalToWorld();
+
+	OutRanges.Empty();
+	for (int32 i = 0; i < PatchOrder.Num(); ++i)
+	{
+		// A patch has the same centre as its component except for its height, so patches overlap their components by their height
+		// This draws each patch a little before its component is culled, and the border between them is always covered
+		FBox bounds = PatchBounds[PatchOrder[i]].TransformBy(local_to_world);
+		float overlap = bounds.GetSize().Z;
+		if (FVector::Dist(bounds.GetCenter(), view_origin) <= cutoff - overlap)
+		{
+			continue;
+		}
+
+		// Merge the patch into the previous range when it follows it in the index buffer
+		if (OutRanges.Num() > 0 && OutRanges.Last().X + OutRanges.Last().Y == i)
+		{
+			++OutRanges.Last().Y;
+		}
+		else
+		{
+			OutRanges.Add(FIntPoint(i, 1));
+		}
+	}
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "PrimitiveSceneProxy.h"
+
+#include "TerrainVertexFactory.h"
+
+class UTerrainFarFieldComponent;
+struct FTerrainVertexData;
+
+// A rendering proxy which draws the low resolution mesh of a whole terrain past the distance its components are culled at
+// Patches are stored in Morton order, so the patches drawn by a view merge into a small number of index ranges
+// Functions for the proxy should only be called on the rendering thread (with the exception of the constructor)
+class FTerrainFarFieldSceneProxy : public FPrimitiveSceneProxy
+{
+public:
+	FTerrainFarFieldSceneProxy(UTerrainFarFieldComponent* Component);
+	virtual ~FTerrainFarFieldSceneProxy();
+
+	/// Scene Proxy Interface ///
+
+	SIZE_T GetTypeHash() const override
+	{
+		static size_t unique_pointer;
+		return reinterpret_cast<size_t>(&unique_pointer);
+	}
+
+	virtual uint32 GetMemoryFootprint() const override
+	{
+		return (sizeof(*this) + GetAllocatedSize());
+	}
+
+	uint32 GetAllocatedSize() const
+	{
+		return(FPrimitiveSceneProxy::GetAllocatedSize() + IndexBuffer.GetAllocatedSize() + PatchOrder.GetAllocatedSize() + PatchBounds.GetAllocatedSize());
+	}
+
+	virtual bool CanBeOccluded() const override
+	{
+		// The proxy covers the entire terrain, so it is almost never occluded as a whole
+		return false;
+	}
+
+	virtual void GetDynamicMeshElements(const TArray< const FSceneView* >& Views, const FSceneViewFamily& ViewFamily, uint32 VisibilityMap, class FMeshElementCollector& Collector) const override;
+	virtual FPrimitiveViewRelevance GetViewRelevance(const FSceneView* View) const override;
+
+	/// Proxy Update Functions ///
+
+	// Upload vertex data for the whole mesh
+	void UpdateVertexData(TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData);
+	// Upload vertex data for spans of whole rows of the mesh, and rebuild the bounds of the patches that changed
+	// Each span holds the vertices of its rows, starting at the matching first row
+	void UpdateVertexRows(const TArray<int32>& FirstRows, const TArray<TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe>>& Rows, const TArray<int32>& Patches);
+	// Change the distance the mesh replaces the components at
+	void UpdateDistance(float NewDistance);
+	// Update UV tiling, this only changes shader parameters
+	void UpdateTiling(float Tiling);
+
+protected:
+	// Create the buffers for the mesh
+	void Initialize(TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData, float Tiling);
+	// Rebuild the bounds of a patch from rows of vertex heights, starting at the given row
+	void BuildPatchBounds(int32 Patch, const TArray<float>& Heights, int32 FirstRow);
+	// Find the ranges of patches to draw for a view, each range is the first patch in draw order and the number of patches
+	void SelectPatches(const FSceneView& View, TArray<FIntPoint>& OutRanges) const;
+
+	// The number of components on each axis, each component has one patch
+	FIntPoint ComponentCount;
+	// The number of quads along each side of a patch
+	int32 Resolution;
+	// The number of quads along each side of a component
+	int32 ComponentPolygons;
+	// The distance the mesh replaces the components at
+	float Distance;
+
+	// The vertex buffers containing mesh data, XY positions and UVs are generated by the vertex factory
+	TTerrainVertexBuffer<float> HeightVertexBuffer;
+	TTerrainVertexBuffer<FTerrainNormalVertex> NormalVertexBuffer;
+	TTerrainVertexBuffer<float> MorphVertexBuffer;
+	// The triangles of every patch, in draw order
+	FTerrainIndexBuffer IndexBuffer;
+	// The vertex factory for the mesh
+	FTerrainVertexFactory VertexFactory;
+	// Morph parameters for the mesh, the far field never morphs
+	TUniformBufferRef<FTerrainLODParameters> LODUniformBuffer;
+
+	// The patch drawn at each position in the index buffer
+	TArray<int32> PatchOrder;
+	// The local bounds of each patch
+	TArray<FBox> PatchBounds;
+
+	// The material used to render the terrain
+	UMaterialInterface* Material;
+	FMaterialRelevance MaterialRelevance;
+};
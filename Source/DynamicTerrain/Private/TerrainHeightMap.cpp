@@ -1,5 +1,14 @@
 #include "TerrainHeightMap.h"
 
+/// Engine Functions ///
+
+void UHeightMap::GetResourceSizeEx(FResourceSizeEx& CumulativeResourceSize)
+{
+	Super::GetResourceSizeEx(CumulativeResourceSize);
+
+	CumulativeResourceSize.AddDedicatedSystemMemoryBytes(MapData.GetAllocatedSize());
+}
+
 /// Blueprint Functions ///
 
 void UHeightMap::Resize(int32 X, int32 Y)
@@ -36,16 +45,29 @@ void UHeightMap::GetMapSection(FMapSection* Section, FIntPoint Min)
 	if (Min.X < 0 || Min.Y < 0 || Min.X + Section->X > WidthX || Min.Y + Section->Y > WidthY)
 		return;
 
-	// Fill the map data
+	// Fill the map data and track the height range of the section interior while copying
+	float min_height = MAX_flt;
+	float max_height = -MAX_flt;
 	int32 i = 0;
 	for (int32 y = Min.Y; y < Min.Y + Section->Y; ++y)
 	{
+		bool interior_row = y > Min.Y && y < Min.Y + Section->Y - 1;
 		for (int32 x = Min.X; x < Min.X + Section->X; ++x)
 		{
-			Section->Data[i] = MapData[y * WidthX + x];
+			float height = MapData[y * WidthX + x];
+			Section->Data[i] = height;
 			++i;
+
+			if (interior_row && x > Min.X && x < Min.X + Section->X - 1)
+			{
+				min_height = FMath::Min(min_height, height);
+				max_height = FMath::Max(max_height, height);
+			}
 		}
 	}
+
+	Section->MinHeight = min_height;
+	Section->MaxHeight = max_height;
 }
 
 float UHeightMap::GetHeight(uint32 X, uint32 Y) const
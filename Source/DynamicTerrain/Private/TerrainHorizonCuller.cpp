@@ -0,0 +1,321 @@
+#include "TerrainHorizonCuller.h"
+
+// The number of directions around the eye the horizon is stored for
+static const int32 TerrainHorizonBins = 256;
+// Pyramid cells are split until they are smaller than this angle as seen from the eye, in radians
+static const float TerrainOccluderAngle = 0.1f;
+
+// Get the range of angles a rectangle covers as seen from a point outside of it, the range may extend past pi
+static void GetAngleRange(const FVector2D& Eye, const FVector2D& Min, const FVector2D& Max, float& OutLow, float& OutHigh)
+{
+	FVector2D center = (Min + Max) * 0.5f - Eye;
+	float middle = FMath::Atan2(center.Y, center.X);
+
+	float low = 0.0f;
+	float high = 0.0f;
+	for (int32 i = 0; i < 4; ++i)
+	{
+		FVector2D corner = FVector2D(i & 1 ? Max.X : Min.X, i & 2 ? Max.Y : Min.Y) - Eye;
+		float delta = FMath::UnwindRadians(FMath::Atan2(corner.Y, corner.X) - middle);
+		low = FMath::Min(low, delta);
+		high = FMath::Max(high, delta);
+	}
+
+	OutLow = middle + low;
+	OutHigh = middle + high;
+}
+
+// Get the nearest and farthest horizontal distance from a point to a rectangle
+static void GetDistanceRange(const FVector2D& Eye, const FVector2D& Min, const FVector2D& Max, float& OutNear, float& OutFar)
+{
+	FVector2D nearest(FMath::Max3(Min.X - Eye.X, 0.0f, Eye.X - Max.X), FMath::Max3(Min.Y - Eye.Y, 0.0f, Eye.Y - Max.Y));
+	FVector2D farthest(FMath::Max(FMath::Abs(Eye.X - Min.X), FMath::Abs(Eye.X - Max.X)), FMath::Max(FMath::Abs(Eye.Y - Min.Y), FMath::Abs(Eye.Y - Max.Y)));
+	OutNear = nearest.Size();
+	OutFar = farthest.Size();
+}
+
+static inline int32 WrapHorizonBin(int32 Bin)
+{
+	return ((Bin % TerrainHorizonBins) + TerrainHorizonBins) % TerrainHorizonBins;
+}
+
+/// Components ///
+
+void FTerrainHorizonCuller::SetComponent(FIntPoint Position, const float* Heights, uint32 Pitch, uint32 Width, float Error)
+{
+	check(Width > 1);
+
+	// Components of a different size can't share a pyramid, so they replace every component
+	if (ComponentPolygons != Width - 1)
+	{
+		Components.Empty();
+		ComponentPolygons = Width - 1;
+	}
+
+	FComponentHeights& component = Components.FindOrAdd(Position);
+	component.MinHeight = MAX_flt;
+	component.MaxHeight = -MAX_flt;
+	for (int32 cy = 0; cy < CellsPerComponent; ++cy)
+	{
+		for (int32 cx = 0; cx < CellsPerComponent; ++cx)
+		{
+			// Include every vertex of the triangles that overlap the cell
+			uint32 x0 = cx * ComponentPolygons / CellsPerComponent;
+			uint32 y0 = cy * ComponentPolygons / CellsPerComponent;
+			uint32 x1 = ((cx + 1) * ComponentPolygons + CellsPerComponent - 1) / CellsPerComponent;
+			uint32 y1 = ((cy + 1) * ComponentPolygons + CellsPerComponent - 1) / CellsPerComponent;
+
+			float min_height = MAX_flt;
+			float max_height = -MAX_flt;
+			for (uint32 y = y0; y <= y1; ++y)
+			{
+				for (uint32 x = x0; x <= x1; ++x)
+				{
+					min_height = FMath::Min(min_height, Heights[y * Pitch + x]);
+					max_height = FMath::Max(max_height, Heights[y * Pitch + x]);
+				}
+			}
+
+			// Coarser LODs may cut under the highest points or bridge over the lowest ones
+			FVector2D& cell = component.Cells[cy * CellsPerComponent + cx];
+			cell = FVector2D(min_height - Error, max_height + Error);
+			component.MinHeight = FMath::Min(component.MinHeight, cell.X);
+			component.MaxHeight = FMath::Max(component.MaxHeight, cell.Y);
+		}
+	}
+
+	PyramidDirty = true;
+}
+
+void FTerrainHorizonCuller::RemoveComponent(FIntPoint Position)
+{
+	if (Components.Remove(Position) > 0)
+	{
+		PyramidDirty = true;
+	}
+}
+
+void FTerrainHorizonCuller::Reset()
+{
+	Components.Empty();
+	PyramidDirty = true;
+}
+
+/// Culling ///
+
+void FTerrainHorizonCuller::GetOccluded(const FVector& Eye, const FIntRect& Grid, TBitArray<>& OutOccluded)
+{
+	OutOccluded.Init(false, Grid.Area());
+
+	if (PyramidDirty)
+	{
+		BuildPyramid();
+	}
+	if (Levels.Num() == 0)
+	{
+		return;
+	}
+
+	FVector2D eye(Eye.X, Eye.Y);
+	float cell_size = (float)ComponentPolygons / CellsPerComponent;
+
+	// Pick occluding cells from the pyramid, using coarse cells where they look small from the eye
+	struct FOccluder
+	{
+		FVector2D Min;
+		FVector2D Max;
+		float Near;
+		float Far;
+		float Height;
+	};
+	TArray<FOccluder> occluders;
+
+	TArray<FIntVector> stack;
+	int32 top = Levels.Num() - 1;
+	for (int32 y = 0; y < LevelSizes[top].Y; ++y)
+	{
+		for (int32 x = 0; x < LevelSizes[top].X; ++x)
+		{
+			stack.Add(FIntVector(x, y, top));
+		}
+	}
+
+	while (stack.Num() > 0)
+	{
+		FIntVector node = stack.Pop(false);
+		int32 level = node.Z;
+		FIntPoint first = FIntPoint(node.X, node.Y) * (1 << level);
+		FIntPoint last = (FIntPoint(node.X, node.Y) + FIntPoint(1, 1)) * (1 << level);
+		last = FIntPoint(FMath::Min(last.X, LevelSizes[0].X), FMath::Min(last.Y, LevelSizes[0].Y));
+
+		FOccluder occluder;
+		occluder.Min = FVector2D(Origin + first) * cell_size;
+		occluder.Max = FVector2D(Origin + last) * cell_size;
+		GetDistanceRange(eye, occluder.Min, occluder.Max, occluder.Near, occluder.Far);
+
+		// Split cells that contain the eye or look too large from it
+		float size = FMath::Max(occluder.Max.X - occluder.Min.X, occluder.Max.Y - occluder.Min.Y);
+		if (level > 0 && (occluder.Near <= 0.0f || size > occluder.Near * TerrainOccluderAngle))
+		{
+			for (int32 y = node.Y * 2; y < FMath::Min(node.Y * 2 + 2, LevelSizes[level - 1].Y); ++y)
+			{
+				for (int32 x = node.X * 2; x < FMath::Min(node.X * 2 + 2, LevelSizes[level - 1].X); ++x)
+				{
+					stack.Add(FIntVector(x, y, level - 1));
+				}
+			}
+			continue;
+		}
+
+		// Cells around the eye and cells without terrain never occlude anything
+		occluder.Height = Levels[level][node.Y * LevelSizes[level].X + node.X].X;
+		if (occluder.Near > 0.0f && occluder.Height > -MAX_flt)
+		{
+			occluders.Add(occluder);
+		}
+	}
+
+	// Find the components to test
+	struct FTarget
+	{
+		int32 Index;
+		FVector2D Min;
+		FVector2D Max;
+		float Near;
+		float Far;
+		float Height;
+	};
+	TArray<FTarget> targets;
+	for (const TPair<FIntPoint, FComponentHeights>& component : Components)
+	{
+		if (!Grid.Contains(component.Key))
+		{
+			continue;
+		}
+
+		FTarget target;
+		target.Index = (component.Key.Y - Grid.Min.Y) * Grid.Width() + component.Key.X - Grid.Min.X;
+		target.Min = FVector2D(component.Key) * ComponentPolygons;
+		target.Max = FVector2D(component.Key + FIntPoint(1, 1)) * ComponentPolygons;
+		target.Height = component.Value.MaxHeight;
+		GetDistanceRange(eye, target.Min, target.Max, target.Near, target.Far);
+
+		// The component under the eye is always visible
+		if (target.Near > 0.0f)
+		{
+			targets.Add(target);
+		}
+	}
+
+	// Sweep from the eye outwards, each target is tested against the occluders that lie completely in front of it
+	occluders.Sort([](const FOccluder& A, const FOccluder& B) { return A.Far < B.Far; });
+	targets.Sort([](const FTarget& A, const FTarget& B) { return A.Near < B.Near; });
+
+	// The horizon holds the lowest slope a ray in each direction must have to clear the terrain in front of it
+	const float bin_width = 2.0f * PI / TerrainHorizonBins;
+	TArray<float> horizon;
+	horizon.Init(-MAX_flt, TerrainHorizonBins);
+
+	int32 next_occluder = 0;
+	for (const FTarget& target : targets)
+	{
+		while (next_occluder < occluders.Num() && occluders[next_occluder].Far <= target.Near)
+		{
+			// A ray under this slope is below the cell's lowest point by the time it leaves the cell
+			const FOccluder& occluder = occluders[next_occluder++];
+			float rise = occluder.Height - Eye.Z;
+			float slope = rise >= 0.0f ? rise / occluder.Far : rise / occluder.Near;
+
+			// Only directions that cross the cell completely can be raised
+			float low, high;
+			GetAngleRange(eye, occluder.Min, occluder.Max, low, high);
+			int32 last_bin = FMath::FloorToInt(high / bin_width) - 1;
+			for (int32 bin = FMath::CeilToInt(low / bin_width); bin <= last_bin; ++bin)
+			{
+				float& current = horizon[WrapHorizonBin(bin)];
+				current = FMath::Max(current, slope);
+			}
+		}
+
+		// The steepest ray that can reach any part of the component
+		float rise = target.Height - Eye.Z;
+		float slope = rise >= 0.0f ? rise / target.Near : rise / target.Far;
+
+		float low, high;
+		GetAngleRange(eye, target.Min, target.Max, low, high);
+		bool occluded = true;
+		int32 last_bin = FMath::FloorToInt(high / bin_width);
+		for (int32 bin = FMath::FloorToInt(low / bin_width); bin <= last_bin && occluded; ++bin)
+		{
+			occluded = horizon[WrapHorizonBin(bin)] > slope;
+		}
+
+		OutOccluded[target.Index] = occluded;
+	}
+}
+
+void FTerrainHorizonCuller::BuildPyramid()
+{
+	PyramidDirty = false;
+	Levels.Empty();
+	LevelSizes.Empty();
+	if (Components.Num() == 0)
+	{
+		return;
+	}
+
+	// Find the area covered by components
+	FIntRect grid(MAX_int32, MAX_int32, MIN_int32, MIN_int32);
+	for (const TPair<FIntPoint, FComponentHeights>& component : Components)
+	{
+		grid.Include(component.Key);
+	}
+	grid.Max += FIntPoint(1, 1);
+	Origin = grid.Min * CellsPerComponent;
+
+	// Copy the cells of each component into the bottom level
+	FIntPoint size = grid.Size() * CellsPerComponent;
+	LevelSizes.Add(size);
+	Levels.AddDefaulted();
+	Levels[0].Init(FVector2D(-MAX_flt, -MAX_flt), size.X * size.Y);
+	for (const TPair<FIntPoint, FComponentHeights>& component : Components)
+	{
+		FIntPoint corner = (component.Key - grid.Min) * CellsPerComponent;
+		for (int32 y = 0; y < CellsPerComponent; ++y)
+		{
+			for (int32 x = 0; x < CellsPerComponent; ++x)
+			{
+				Levels[0][(corner.Y + y) * size.X + corner.X + x] = component.Value.Cells[y * CellsPerComponent + x];
+			}
+		}
+	}
+
+	// Each level keeps the lowest and highest heights of the four cells below it
+	while (size.X > 1 || size.Y > 1)
+	{
+		FIntPoint next_size((size.X + 1) / 2, (size.Y + 1) / 2);
+		const TArray<FVector2D>& below = Levels.Last();
+		TArray<FVector2D> level;
+		level.SetNumUninitialized(next_size.X * next_size.Y);
+		for (int32 y = 0; y < next_size.Y; ++y)
+		{
+			for (int32 x = 0; x < next_size.X; ++x)
+			{
+				FVector2D cell(MAX_flt, -MAX_flt);
+				for (int32 cy = y * 2; cy < FMath::Min(y * 2 + 2, size.Y); ++cy)
+				{
+					for (int32 cx = x * 2; cx < FMath::Min(x * 2 + 2, size.X); ++cx)
+					{
+						cell.X = FMath::Min(cell.X, below[cy * size.X + cx].X);
+						cell.Y = FMath::Max(cell.Y, below[cy * size.X + cx].Y);
+					}
+				}
+				level[y * next_size.X + x] = cell;
+			}
+		}
+
+		Levels.Add(MoveTemp(level));
+		LevelSizes.Add(next_size);
+		size = next_size;
+	}
+}
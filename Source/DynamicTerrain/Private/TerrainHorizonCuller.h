@@ -0,0 +1,59 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Conservative occlusion culling of terrain components against the terrain itself
+// Each component is split into cells with the lowest and highest height the component can be drawn with, and the cells
+// are merged into a min/max pyramid so distant parts of the terrain can occlude with a few large cells
+// Cells are swept front to back from the eye into a horizon of elevation slopes around it, and a component is hidden
+// when its highest point stays under the horizon in every direction it covers
+// The culler only depends on core types, and positions are in terrain space where each component is ComponentPolygons wide
+class FTerrainHorizonCuller
+{
+public:
+	// Set the heights of a component from its full resolution grid, Error is how far its LODs can stray from the grid
+	void SetComponent(FIntPoint Position, const float* Heights, uint32 Pitch, uint32 Width, float Error);
+	// Remove a component, it will neither occlude nor be occluded
+	void RemoveComponent(FIntPoint Position);
+	// Remove every component
+	void Reset();
+
+	// Find the components inside Grid that are hidden from Eye, the result is indexed by row within Grid
+	void GetOccluded(const FVector& Eye, const FIntRect& Grid, TBitArray<>& OutOccluded);
+
+	// Get the width of a component in terrain space
+	inline uint32 GetComponentPolygons() const
+	{
+		return ComponentPolygons;
+	}
+
+	// The number of cells along each side of a component
+	static const int32 CellsPerComponent = 4;
+
+protected:
+	// The height range of a component and its cells, widened by the component's LOD error
+	struct FComponentHeights
+	{
+		float MinHeight = 0.0f;
+		float MaxHeight = 0.0f;
+		// The lowest and highest height of each cell in X and Y
+		FVector2D Cells[CellsPerComponent * CellsPerComponent];
+	};
+
+	// Rebuild the cell pyramid from the current components
+	void BuildPyramid();
+
+	// The heights of every component
+	TMap<FIntPoint, FComponentHeights> Components;
+	// The width of a component in terrain space
+	uint32 ComponentPolygons = 0;
+
+	// The cell at the corner of level 0 of the pyramid
+	FIntPoint Origin;
+	// The number of cells along each axis of each level, each level halves the one below it
+	TArray<FIntPoint> LevelSizes;
+	// The height range of each cell of each level, cells without terrain can't occlude anything
+	TArray<TArray<FVector2D>> Levels;
+	// Set to true when the pyramid no longer matches the components
+	bool PyramidDirty = true;
+};
@@ -0,0 +1,479 @@
+#include "TerrainMeshTemplate.h"
+
+#include "Terrain.h"
+#include "TerrainStat.h"
+
+#include "Misc/ScopeLock.h"
+
+/// Template Cache ///
+
+TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> FTerrainMeshTemplate::Get(uint32 Size)
+{
+	static FCriticalSection cache_lock;
+	static TMap<uint32, TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe>> cache;
+
+	FScopeLock lock(&cache_lock);
+	if (const TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe>* existing = cache.Find(Size))
+	{
+		return *existing;
+	}
+
+	TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> new_template = MakeShareable(new FTerrainMeshTemplate(Size));
+	cache.Add(Size, new_template);
+	return new_template;
+}
+
+/// Template Construction ///
+
+FTerrainMeshTemplate::FTerrainMeshTemplate(uint32 ComponentSize)
+{
+	Size = ComponentSize;
+	Width = GetTerrainComponentWidth(Size);
+
+	// Create a grid for every stride that leaves at least one polygon
+	LODIndices.SetNum(Size);
+	for (uint32 i = 0; i < Size; ++i)
+	{
+		BuildGridIndices(LODIndices[i], FMath::Exp2(i));
+		float grid_ratio = GetCacheMissRatio(LODIndices[i]);
+		OptimizeVertexCache(LODIndices[i], Width * Width);
+		UE_LOG(LogDynamicTerrain, Verbose, TEXT("Mesh template %u LOD %u: ACMR %.3f in grid order, %.3f after vertex cache optimization"), Size, i, grid_ratio, GetCacheMissRatio(LODIndices[i]));
+	}
+}
+
+void FTerrainMeshTemplate::BuildGridIndices(TArray<uint32>& Indices, uint32 Stride) const
+{
+	uint32 polygons = (Width - 1) / Stride;
+
+	Indices.Empty();
+	Indices.SetNumUninitialized(polygons * polygons * 6);
+	for (uint32 y = 0; y < polygons; y++)
+	{
+		for (uint32 x = 0; x < polygons; x++)
+		{
+			uint32 i = (y * polygons + x) * 6;
+
+			Indices[i] = x * Stride + y * Stride * Width;
+			Indices[i + 1] = (1 + x) * Stride + (y + 1) * Stride * Width;
+			Indices[i + 2] = (1 + x) * Stride + y * Stride * Width;
+
+			Indices[i + 3] = x * Stride + y * Stride * Width;
+			Indices[i + 4] = x * Stride + (y + 1) * Stride * Width;
+			Indices[i + 5] = (1 + x) * Stride + (y + 1) * Stride * Width;
+		}
+	}
+}
+
+/// Template Interface ///
+
+void FTerrainMeshTemplate::GetStitchedIndices(int32 LOD, uint32 EdgeMask, TArray<uint32>& OutIndices) const
+{
+	StitchIndices(LODIndices[LOD], LOD, EdgeMask, OutIndices);
+
+	// Collapsing an edge can shift which rows stay in the cache, so grids that only just miss it may do better in grid order
+	if (EdgeMask != 0)
+	{
+		TArray<uint32> grid;
+		TArray<uint32> stitched_grid;
+		BuildGridIndices(grid, FMath::Exp2(LOD));
+		StitchIndices(grid, LOD, EdgeMask, stitched_grid);
+		if (GetCacheMissRatio(stitched_grid) < GetCacheMissRatio(OutIndices))
+		{
+			OutIndices = MoveTemp(stitched_grid);
+		}
+	}
+}
+
+void FTerrainMeshTemplate::StitchIndices(const TArray<uint32>& Indices, int32 LOD, uint32 EdgeMask, TArray<uint32>& OutIndices) const
+{
+	const TArray<uint32>& source = Indices;
+	uint32 coarse_stride = FMath::Exp2(LOD + 1);
+
+	// Move a vertex on a stitched edge back to the previous vertex of the coarser grid
+	// This turns the triangles along the edge into fans that meet the neighbour's edge exactly
+	auto stitch = [&](uint32 index) -> uint32
+	{
+		uint32 x = index % Width;
+		uint32 y = index / Width;
+		if ((x == 0 && (EdgeMask & ETerrainEdge::NegativeX)) || (x == Width - 1 && (EdgeMask & ETerrainEdge::PositiveX)))
+		{
+			y -= y % coarse_stride;
+		}
+		if ((y == 0 && (EdgeMask & ETerrainEdge::NegativeY)) || (y == Width - 1 && (EdgeMask & ETerrainEdge::PositiveY)))
+		{
+			x -= x % coarse_stride;
+		}
+		return y * Width + x;
+	};
+
+	OutIndices.Empty(source.Num());
+	for (int32 i = 0; i + 2 < source.Num(); i += 3)
+	{
+		uint32 a = stitch(source[i]);
+		uint32 b = stitch(source[i + 1]);
+		uint32 c = stitch(source[i + 2]);
+		if (a != b && b != c && a != c)
+		{
+			OutIndices.Add(a);
+			OutIndices.Add(b);
+			OutIndices.Add(c);
+		}
+	}
+}
+
+void FTerrainMeshTemplate::OptimizeVertexCache(TArray<uint32>& Indices, uint32 NumVertices)
+{
+	const int32 cache_size = VertexCacheSize;
+	int32 num_triangles = Indices.Num() / 3;
+	if (num_triangles == 0)
+	{
+		return;
+	}
+
+	// Vertices score higher the more recently they were used, and the fewer triangles they have left
+	auto vertex_score = [cache_size](int32 CachePosition, int32 Remaining) -> float
+	{
+		if (Remaining == 0)
+		{
+			return -1.0f;
+		}
+
+		// The vertices of the last triangle get a fixed score, so the next triangle doesn't favour reusing all three
+		float score = 0.0f;
+		if (CachePosition >= 0)
+		{
+			score = CachePosition < 3 ? 0.75f : FMath::Pow(1.0f - (float)(CachePosition - 3) / (cache_size - 3), 1.5f);
+		}
+
+		// Finishing off vertices with few triangles left stops them from lingering in the cache
+		return score + 2.0f * FMath::InvSqrt((float)Remaining);
+	};
+
+	// Find the triangles around each vertex, the triangles still to be added are kept at the front of each list
+	TArray<int32> remaining;
+	remaining.SetNumZeroed(NumVertices);
+	for (uint32 index : Indices)
+	{
+		++remaining[index];
+	}
+
+	TArray<int32> offsets;
+	offsets.SetNumUninitialized(NumVertices + 1);
+	offsets[0] = 0;
+	for (uint32 v = 0; v < NumVertices; ++v)
+	{
+		offsets[v + 1] = offsets[v] + remaining[v];
+	}
+
+	TArray<int32> adjacency;
+	adjacency.SetNumUninitialized(Indices.Num());
+	TArray<int32> fill(offsets.GetData(), NumVertices);
+	for (int32 i = 0; i < Indices.Num(); ++i)
+	{
+		adjacency[fill[Indices[i]]++] = i / 3;
+	}
+
+	// Score every vertex and triangle
+	TArray<int32> cache_positions;
+	cache_positions.Init(-1, NumVertices);
+	TArray<float> vertex_scores;
+	vertex_scores.SetNumUninitialized(NumVertices);
+	for (uint32 v = 0; v < NumVertices; ++v)
+	{
+		vertex_scores[v] = vertex_score(-1, remaining[v]);
+	}
+
+	TArray<float> triangle_scores;
+	triangle_scores.SetNumUninitialized(num_triangles);
+	for (int32 t = 0; t < num_triangles; ++t)
+	{
+		triangle_scores[t] = vertex_scores[Indices[t * 3]] + vertex_scores[Indices[t * 3 + 1]] + vertex_scores[Indices[t * 3 + 2]];
+	}
+
+	TBitArray<> added(false, num_triangles);
+	TArray<uint32> output;
+	output.Reserve(Indices.Num());
+	TArray<uint32, TInlineAllocator<cache_size + 3>> cache;
+	TArray<uint32, TInlineAllocator<cache_size + 3>> new_cache;
+	int32 best = -1;
+	int32 cursor = 0;
+
+	for (int32 n = 0; n < num_triangles; ++n)
+	{
+		// When no triangle in the cache is left, continue from the first triangle that hasn't been added
+		if (best < 0)
+		{
+			while (added[cursor])
+			{
+				++cursor;
+			}
+			best = cursor;
+		}
+
+		// Add the triangle and move its vertices to the front of the cache
+		added[best] = true;
+		new_cache.Reset();
+		for (int32 k = 0; k < 3; ++k)
+		{
+			uint32 v = Indices[best * 3 + k];
+			output.Add(v);
+			new_cache.AddUnique(v);
+
+			// Remove the triangle from the triangles the vertex has left
+			int32* triangles = &adjacency[offsets[v]];
+			for (int32 i = 0; i < remaining[v]; ++i)
+			{
+				if (triangles[i] == best)
+				{
+					Swap(triangles[i], triangles[remaining[v] - 1]);
+					--remaining[v];
+					break;
+				}
+			}
+		}
+		for (uint32 v : cache)
+		{
+			new_cache.AddUnique(v);
+		}
+
+		// Rescore the vertices in the cache, including the ones that just fell out of it
+		for (int32 i = 0; i < new_cache.Num(); ++i)
+		{
+			uint32 v = new_cache[i];
+			cache_positions[v] = i < cache_size ? i : -1;
+			float score = vertex_score(cache_positions[v], remaining[v]);
+			float delta = score - vertex_scores[v];
+			vertex_scores[v] = score;
+
+			for (int32 j = offsets[v]; j < offsets[v] + remaining[v]; ++j)
+			{
+				triangle_scores[adjacency[j]] += delta;
+			}
+		}
+		new_cache.SetNum(FMath::Min(new_cache.Num(), cache_size), false);
+		Swap(cache, new_cache);
+
+		// The next triangle is the best one that uses a vertex in the cache
+		best = -1;
+		float best_score = -1.0f;
+		for (uint32 v : cache)
+		{
+			for (int32 j = offsets[v]; j < offsets[v] + remaining[v]; ++j)
+			{
+				if (triangle_scores[adjacency[j]] > best_score)
+				{
+					best = adjacency[j];
+					best_score = triangle_scores[best];
+				}
+			}
+		}
+	}
+
+	// Small grids can already be close to ideal, so only keep the new order if it actually transforms fewer vertices
+	if (GetCacheMissRatio(output) < GetCacheMissRatio(Indices))
+	{
+		Indices = MoveTemp(output);
+	}
+}
+
+float FTerrainMeshTemplate::GetCacheMissRatio(const TArray<uint32>& Indices, int32 CacheSize)
+{
+	if (Indices.Num() < 3)
+	{
+		return 0.0f;
+	}
+
+	TArray<uint32> cache;
+	int32 misses = 0;
+	for (uint32 index : Indices)
+	{
+		if (!cache.Contains(index))
+		{
+			++misses;
+			cache.Add(index);
+			if (cache.Num() > CacheSize)
+			{
+				cache.RemoveAt(0, 1, false);
+			}
+		}
+	}
+
+	return (float)misses / (Indices.Num() / 3);
+}
+
+float FTerrainMeshTemplate::GetLODHeight(const float* Heights, uint32 Pitch, int32 LOD, uint32 X, uint32 Y) const
+{
+	uint32 stride = FMath::Exp2(LOD);
+	uint32 cells = (Width - 1) / stride;
+
+	// Find the cell of the LOD that covers the vertex
+	uint32 cx = FMath::Min(X / stride, cells - 1);
+	uint32 cy = FMath::Min(Y / stride, cells - 1);
+	float u = (float)(X - cx * stride) / stride;
+	float v = (float)(Y - cy * stride) / stride;
+
+	const float* cell = Heights + cy * stride * Pitch + cx * stride;
+	float h00 = cell[0];
+	float h10 = cell[stride];
+	float h01 = cell[stride * Pitch];
+	float h11 = cell[stride * Pitch + stride];
+
+	// Each cell is split along the diagonal from (0, 0) to (1, 1), matching BuildGridIndices
+	return u >= v ? h00 + u * (h10 - h00) + v * (h11 - h10) : h00 + v * (h01 - h00) + u * (h11 - h01);
+}
+
+void FTerrainMeshTemplate::GetMorphHeights(const float* Heights, uint32 Pitch, uint32 Row, float* OutMorphHeights) const
+{
+	for (uint32 x = 0; x < Width; ++x)
+	{
+		float height = Heights[Row * Pitch + x];
+
+		// Vertices on the edge are shared with neighbouring components, which may be using a different LOD
+		if (x == 0 || Row == 0 || x == Width - 1 || Row == Width - 1)
+		{
+			OutMorphHeights[x] = height;
+			continue;
+		}
+
+		// The coarsest LOD a vertex is part of depends on how many times its coordinates can be halved
+		int32 level = FMath::Min(FMath::CountTrailingZeros(x), FMath::CountTrailingZeros(Row));
+		OutMorphHeights[x] = level + 1 < GetNumLODs() ? GetLODHeight(Heights, Pitch, level + 1, x, Row) : height;
+	}
+}
+
+void FTerrainMeshTemplate::GetLODErrors(const float* Heights, uint32 Pitch, TArray<float>& OutErrors) const
+{
+	OutErrors.Empty();
+	OutErrors.SetNumZeroed(GetNumLODs());
+
+	for (int32 lod = 1; lod < GetNumLODs(); ++lod)
+	{
+		// Compare every vertex to the surface of the coarse triangle that covers it
+		float error = OutErrors[lod - 1];
+		for (uint32 y = 0; y < Width; ++y)
+		{
+			for (uint32 x = 0; x < Width; ++x)
+			{
+				error = FMath::Max(error, FMath::Abs(Heights[y * Pitch + x] - GetLODHeight(Heights, Pitch, lod, x, y)));
+			}
+		}
+
+		OutErrors[lod] = error;
+	}
+}
+
+void FTerrainMeshTemplate::GetAdaptiveErrors(const float* Heights, uint32 Pitch, TArray<float>& OutErrors) const
+{
+	int32 tile = Width - 1;
+	int32 num_triangles = tile * tile * 2 - 2;
+	int32 num_parents = num_triangles - tile * tile;
+
+	// Edge vertices can never be removed, and the error carries up to every triangle that contains them
+	// Coarse LODs keep full resolution borders, since adaptive components aren't stitched and their neighbours may draw any LOD
+	OutErrors.Empty();
+	OutErrors.SetNumZeroed(Width * Width);
+	for (uint32 i = 0; i < Width; ++i)
+	{
+		OutErrors[i] = MAX_flt;
+		OutErrors[tile * Width + i] = MAX_flt;
+		OutErrors[i * Width] = MAX_flt;
+		OutErrors[i * Width + tile] = MAX_flt;
+	}
+
+	// Visit triangles from the smallest to the largest, so children are always finished before their parents
+	for (int32 i = num_triangles - 1; i >= 0; --i)
+	{
+		// Triangles are numbered like a binary heap below the two root triangles, follow the path to the triangle to find its corners
+		uint32 id = i + 2;
+		int32 ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+		if (id & 1)
+		{
+			bx = by = cx = tile;
+		}
+		else
+		{
+			ax = ay = cy = tile;
+		}
+		while ((id >>= 1) > 1)
+		{
+			int32 mx = (ax + bx) >> 1;
+			int32 my = (ay + by) >> 1;
+			if (id & 1)
+			{
+				bx = ax;
+				by = ay;
+				ax = cx;
+				ay = cy;
+			}
+			else
+			{
+				ax = bx;
+				ay = by;
+				bx = cx;
+				by = cy;
+			}
+			cx = mx;
+			cy = my;
+		}
+
+		// The error of the vertex in the middle of the longest edge if the triangle isn't split
+		int32 mx = (ax + bx) >> 1;
+		int32 my = (ay + by) >> 1;
+		float interpolated = (Heights[ay * Pitch + ax] + Heights[by * Pitch + bx]) * 0.5f;
+		float& error = OutErrors[my * Width + mx];
+		error = FMath::Max(error, FMath::Abs(interpolated - Heights[my * Pitch + mx]));
+
+		// Splitting a child means splitting the parent as well
+		if (i < num_parents)
+		{
+			error = FMath::Max(error, OutErrors[((ay + cy) >> 1) * Width + ((ax + cx) >> 1)]);
+			error = FMath::Max(error, OutErrors[((by + cy) >> 1) * Width + ((bx + cx) >> 1)]);
+		}
+	}
+}
+
+void FTerrainMeshTemplate::GetAdaptiveIndices(const TArray<float>& Errors, float MaxError, TArray<uint32>& OutIndices) const
+{
+	check(Errors.Num() == Width * Width);
+	int32 tile = Width - 1;
+
+	// Each entry holds the corners of a triangle, AB is the longest edge and the corners are wound the same way as the grid
+	TArray<FIntPoint, TInlineAllocator<64>> stack;
+	stack.Append({ FIntPoint(0, 0), FIntPoint(tile, tile), FIntPoint(tile, 0) });
+	stack.Append({ FIntPoint(tile, tile), FIntPoint(0, 0), FIntPoint(0, tile) });
+
+	OutIndices.Empty();
+	while (stack.Num() > 0)
+	{
+		FIntPoint c = stack.Pop(false);
+		FIntPoint b = stack.Pop(false);
+		FIntPoint a = stack.Pop(false);
+		FIntPoint m = (a + b) / 2;
+
+		// Split the triangle in two when it is larger than a single cell and removing the middle vertex adds too much error
+		if (FMath::Abs(a.X - c.X) + FMath::Abs(a.Y - c.Y) > 1 && Errors[m.Y * Width + m.X] > MaxError)
+		{
+			stack.Append({ b, c, m });
+			stack.Append({ c, a, m });
+		}
+		else
+		{
+			OutIndices.Add(a.Y * Width + a.X);
+			OutIndices.Add(b.Y * Width + b.X);
+			OutIndices.Add(c.Y * Width + c.X);
+		}
+	}
+
+#if DO_GUARD_SLOW
+	// Every vertex on the edge of the grid must be used, otherwise the mesh would crack against its neighbours
+	TBitArray<> used(false, Width * Width);
+	for (uint32 index : OutIndices)
+	{
+		used[index] = true;
+	}
+	for (uint32 i = 0; i < Width; ++i)
+	{
+		checkSlow(used[i] && used[tile * Width + i] && used[i * Width] && used[i * Width + tile]);
+	}
+#endif
+}
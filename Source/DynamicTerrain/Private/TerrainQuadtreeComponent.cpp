@@ -0,0 +1,459 @@
+#include "TerrainQuadtreeComponent.h"
+
+#include "Terrain.h"
+#include "TerrainQuadtreeRender.h"
+#include "TerrainStat.h"
+
+#include "Engine.h"
+#include "Materials/Material.h"
+#include "Async/ParallelFor.h"
+#include "Async/Async.h"
+
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Build Quadtree"), STAT_DynamicTerrain_BuildQuadtree, STATGROUP_DynamicTerrain);
+
+// Get the largest vertical distance between a grid and the same grid at half resolution
+// Heights holds Width * Width vertices, where Width is odd, and the half resolution grid is split like the mesh template
+static float GetHalfResolutionError(const TArray<float>& Heights, uint32 Width)
+{
+	float error = 0.0f;
+	uint32 cells = (Width - 1) / 2;
+	for (uint32 y = 0; y < Width; ++y)
+	{
+		uint32 cy = FMath::Min(y / 2, cells - 1);
+		float v = (y - cy * 2) * 0.5f;
+		for (uint32 x = 0; x < Width; ++x)
+		{
+			uint32 cx = FMath::Min(x / 2, cells - 1);
+			float u = (x - cx * 2) * 0.5f;
+
+			const float* cell = &Heights[cy * 2 * Width + cx * 2];
+			float h00 = cell[0];
+			float h10 = cell[2];
+			float h01 = cell[2 * Width];
+			float h11 = cell[2 * Width + 2];
+
+			float surface = u >= v ? h00 + u * (h10 - h00) + v * (h11 - h10) : h00 + v * (h01 - h00) + u * (h11 - h01);
+			error = FMath::Max(error, FMath::Abs(Heights[y * Width + x] - surface));
+		}
+	}
+
+	return error;
+}
+
+/// Mesh Component Interface ///
+
+UTerrainQuadtreeComponent::UTerrainQuadtreeComponent(const FObjectInitializer& ObjectInitializer)
+{
+	Size = 0;
+	ComponentCount = FIntPoint::ZeroValue;
+	Tiling = 1.0f;
+	LODErrorThreshold = 2.0f;
+	ShadowLODBias = 1;
+	Map = nullptr;
+
+	// Disable ticking for the component to save some CPU cycles
+	PrimaryComponentTick.bCanEverTick = false;
+
+	// Collision is provided by the terrain's components
+	SetCollisionEnabled(ECollisionEnabled::NoCollision);
+}
+
+FPrimitiveSceneProxy* UTerrainQuadtreeComponent::CreateSceneProxy()
+{
+	FPrimitiveSceneProxy* proxy = nullptr;
+
+	// Nodes are not saved with the component, they are rebuilt by the terrain after loading
+	if (Size > 1 && Nodes.Num() > 0 && NodesBuilt && MeshTemplate.IsValid())
+	{
+		proxy = new FTerrainQuadtreeSceneProxy(this);
+	}
+
+	return proxy;
+}
+
+int32 UTerrainQuadtreeComponent::GetNumMaterials() const
+{
+	return 1;
+}
+
+FBoxSphereBounds UTerrainQuadtreeComponent::CalcBounds(const FTransform& LocalToWorld) const
+{
+	FBox bound(ForceInit);
+
+	if (Nodes.Num() > 0 && NodesBuilt && Size > 1)
+	{
+		// Level 0 nodes cover every component and track the height range of the map under them
+		float min_height = MAX_flt;
+		float max_height = -MAX_flt;
+		for (int32 i = 0; i < LevelSizes[0].X * LevelSizes[0].Y; ++i)
+		{
+			min_height = FMath::Min(min_height, Nodes[i].Section->MinHeight);
+			max_height = FMath::Max(max_height, Nodes[i].Section->MaxHeight);
+		}
+
+		uint32 polygons = GetTerrainComponentWidth(Size) - 1;
+		bound = FBox(FVector(0.0f, 0.0f, min_height), FVector(ComponentCount.X * polygons, ComponentCount.Y * polygons, max_height)).TransformBy(LocalToWorld);
+	}
+
+	FBoxSphereBounds boxsphere;
+	boxsphere.BoxExtent = bound.GetExtent();
+	boxsphere.Origin = bound.GetCenter();
+	boxsphere.SphereRadius = boxsphere.BoxExtent.Size();
+
+	return boxsphere;
+}
+
+/// Terrain Interface ///
+
+void UTerrainQuadtreeComponent::Initialize(ATerrain* Terrain)
+{
+	Size = Terrain->GetComponentSize();
+	ComponentCount = FIntPoint(Terrain->GetXWidth(), Terrain->GetYWidth());
+	Tiling = Terrain->GetTiling();
+	LODErrorThreshold = Terrain->GetLODErrorThreshold();
+	ShadowLODBias = Terrain->GetShadowLODBias();
+	Map = Terrain->GetMap();
+	MeshTemplate = FTerrainMeshTemplate::Get(Size);
+	SetMaterial(0, Terrain->GetMaterials());
+
+	// Only nodes that fit completely inside the terrain exist, the renderer splits any node that would stick out
+	LevelSizes.Empty();
+	LevelOffsets.Empty();
+	int32 num_nodes = 0;
+	for (FIntPoint level_size = ComponentCount; level_size.X > 0 && level_size.Y > 0; level_size /= 2)
+	{
+		LevelSizes.Add(level_size);
+		LevelOffsets.Add(num_nodes);
+		num_nodes += level_size.X * level_size.Y;
+	}
+
+	Nodes.Empty();
+	Nodes.SetNum(num_nodes);
+	for (int32 level = 0; level < LevelSizes.Num(); ++level)
+	{
+		for (int32 i = 0; i < LevelSizes[level].X * LevelSizes[level].Y; ++i)
+		{
+			FTerrainQuadtreeNode& node = Nodes[LevelOffsets[level] + i];
+			node.Level = level;
+			node.Position = FIntPoint(i % LevelSizes[level].X, i / LevelSizes[level].X);
+		}
+	}
+
+	// The proxy is created once every node has been built, this job supersedes any job of the previous layout
+	NodesBuilt = false;
+	PendingComponents.Empty();
+	TArray<int32> indices;
+	indices.SetNumUninitialized(num_nodes);
+	for (int32 i = 0; i < num_nodes; ++i)
+	{
+		indices[i] = i;
+	}
+	StartBuild(indices);
+}
+
+void UTerrainQuadtreeComponent::UpdateComponents(const TArray<int32>& Components)
+{
+	if (Nodes.Num() == 0 || Map == nullptr)
+	{
+		return;
+	}
+
+	// A running job is left to finish, the changed components are built after it so continuous edits can't starve it
+	for (int32 component : Components)
+	{
+		PendingComponents.AddUnique(component);
+	}
+	if (!Building)
+	{
+		StartPendingBuild();
+	}
+}
+
+void UTerrainQuadtreeComponent::SetLODErrorThreshold(float Pixels)
+{
+	LODErrorThreshold = Pixels;
+
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainQuadtreeSceneProxy* proxy = (FTerrainQuadtreeSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FQuadtreeUpdate)([proxy, Pixels](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateLODErrorThreshold(Pixels);
+			});
+	}
+}
+
+void UTerrainQuadtreeComponent::SetShadowLODBias(int32 Bias)
+{
+	ShadowLODBias = Bias;
+
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainQuadtreeSceneProxy* proxy = (FTerrainQuadtreeSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FQuadtreeUpdate)([proxy, Bias](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateShadowLODBias(Bias);
+			});
+	}
+}
+
+void UTerrainQuadtreeComponent::SetTiling(float NewTiling)
+{
+	Tiling = NewTiling;
+
+	if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainQuadtreeSceneProxy* proxy = (FTerrainQuadtreeSceneProxy*)SceneProxy;
+		ENQUEUE_RENDER_COMMAND(FQuadtreeUpdate)([proxy, NewTiling](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateTiling(NewTiling);
+			});
+	}
+}
+
+int32 UTerrainQuadtreeComponent::GetNodeIndex(int32 Level, int32 X, int32 Y) const
+{
+	return GetNodeIndex(LevelSizes, LevelOffsets, Level, X, Y);
+}
+
+int32 UTerrainQuadtreeComponent::GetNodeIndex(const TArray<FIntPoint>& Sizes, const TArray<int32>& Offsets, int32 Level, int32 X, int32 Y)
+{
+	if (Level < 0 || Level >= Sizes.Num() || X < 0 || Y < 0 || X >= Sizes[Level].X || Y >= Sizes[Level].Y)
+	{
+		return INDEX_NONE;
+	}
+
+	return Offsets[Level] + Y * Sizes[Level].X + X;
+}
+
+/// Build Jobs ///
+
+void UTerrainQuadtreeComponent::StartBuild(const TArray<int32>& Indices)
+{
+	int32 version = BuildVersion->Increment();
+	Building = false;
+	if (Indices.Num() == 0 || Map == nullptr || Size < 2)
+	{
+		return;
+	}
+
+	// Errors are built from the children of each node, so the job builds the nodes one level at a time
+	TArray<TArray<int32>> levels;
+	levels.SetNum(LevelSizes.Num());
+	for (int32 i = 0; i < Indices.Num(); ++i)
+	{
+		levels[Nodes[Indices[i]].Level].Add(i);
+	}
+
+	// The job only gets copies of the nodes it builds, the heights under them, and the current errors of their children
+	// Each node is sampled from the heightmap at the resolution of its children, so later edits can't touch the job's data
+	TArray<FTerrainQuadtreeNode> nodes;
+	TArray<FMapSection> samples;
+	TMap<int32, float> errors;
+	nodes.Reserve(Indices.Num());
+	samples.Reserve(Indices.Num());
+	for (int32 index : Indices)
+	{
+		const FTerrainQuadtreeNode& node = Nodes[index];
+		nodes.Add(node);
+		samples.AddDefaulted();
+		SampleNode(*Map, Size, node, samples.Last());
+
+		for (int32 child = 0; child < 4 && node.Level > 0; ++child)
+		{
+			int32 child_index = GetNodeIndex(node.Level - 1, node.Position.X * 2 + (child & 1), node.Position.Y * 2 + (child >> 1));
+			check(child_index != INDEX_NONE);
+			errors.Add(child_index, Nodes[child_index].Error);
+		}
+	}
+	Building = true;
+
+	TWeakObjectPtr<UTerrainQuadtreeComponent> component(this);
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> latest = BuildVersion;
+	TArray<int32> indices = Indices;
+	TArray<FIntPoint> level_sizes = LevelSizes;
+	TArray<int32> level_offsets = LevelOffsets;
+	uint32 size = Size;
+	Async(EAsyncExecution::ThreadPool, [component, latest, version, indices, levels, nodes, samples, errors, level_sizes, level_offsets, size]() mutable {
+		SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_BuildQuadtree);
+
+		for (int32 level = 0; level < levels.Num(); ++level)
+		{
+			if (latest->GetValue() != version)
+			{
+				return;
+			}
+
+			ParallelFor(levels[level].Num(), [&](int32 i) {
+				int32 local = levels[level][i];
+				FTerrainQuadtreeNode& node = nodes[local];
+				float child_error = 0.0f;
+				for (int32 child = 0; child < 4 && level > 0; ++child)
+				{
+					int32 child_index = GetNodeIndex(level_sizes, level_offsets, level - 1, node.Position.X * 2 + (child & 1), node.Position.Y * 2 + (child >> 1));
+					child_error = FMath::Max(child_error, errors.FindChecked(child_index));
+				}
+
+				BuildNodeSection(samples[local], size, node);
+				BuildNodeError(samples[local], size, child_error, node);
+				});
+
+			// The parents on the next level read the errors of the nodes built on this one
+			for (int32 local : levels[level])
+			{
+				if (float* error = errors.Find(indices[local]))
+				{
+					*error = nodes[local].Error;
+				}
+			}
+		}
+
+		AsyncTask(ENamedThreads::GameThread, [component, version, indices, nodes]() {
+			if (component.IsValid())
+			{
+				component->FinishBuild(version, indices, nodes);
+			}
+			});
+		});
+}
+
+void UTerrainQuadtreeComponent::StartPendingBuild()
+{
+	// Find every node that covers a changed component
+	TArray<int32> indices;
+	for (int32 level = 0; level < LevelSizes.Num(); ++level)
+	{
+		for (int32 component : PendingComponents)
+		{
+			int32 index = GetNodeIndex(level, (component % ComponentCount.X) >> level, (component / ComponentCount.X) >> level);
+			if (index != INDEX_NONE)
+			{
+				indices.AddUnique(index);
+			}
+		}
+	}
+	PendingComponents.Empty();
+	StartBuild(indices);
+}
+
+void UTerrainQuadtreeComponent::FinishBuild(int32 Version, const TArray<int32>& Indices, const TArray<FTerrainQuadtreeNode>& NewNodes)
+{
+	// Discard the results of jobs that were superseded while they were running
+	if (Version != BuildVersion->GetValue())
+	{
+		return;
+	}
+
+	Building = false;
+	for (int32 i = 0; i < Indices.Num(); ++i)
+	{
+		Nodes[Indices[i]] = NewNodes[i];
+	}
+	UpdateBounds();
+
+	// A full build replaces the proxy, otherwise only the changed nodes are sent to it
+	if (!NodesBuilt)
+	{
+		NodesBuilt = true;
+		MarkRenderStateDirty();
+	}
+	else if (SceneProxy != nullptr && !IsRenderStateDirty())
+	{
+		FTerrainQuadtreeSceneProxy* proxy = (FTerrainQuadtreeSceneProxy*)SceneProxy;
+		TArray<int32> indices = Indices;
+		TArray<FTerrainQuadtreeNode> nodes = NewNodes;
+		ENQUEUE_RENDER_COMMAND(FQuadtreeUpdate)([proxy, indices, nodes](FRHICommandListImmediate& RHICmdList) {
+			proxy->UpdateNodes(indices, nodes);
+			});
+		MarkRenderTransformDirty();
+	}
+
+	// Components changed while the job was running are built from the heights they have now
+	if (PendingComponents.Num() > 0)
+	{
+		StartPendingBuild();
+	}
+}
+
+/// Node Generation ///
+
+// Nodes above level 0 are sampled at the resolution of their children, which covers both their own grid and their error
+static int32 GetSampleStep(int32 Level)
+{
+	return Level > 0 ? 1 << (Level - 1) : 1;
+}
+
+void UTerrainQuadtreeComponent::SampleNode(const UHeightMap& Map, uint32 Size, const FTerrainQuadtreeNode& Node, FMapSection& Samples)
+{
+	// The first vertex of the node is offset past the heightmap's border, and the samples cover the node's border as well
+	int32 width = GetTerrainComponentWidth(Size);
+	int32 stride = 1 << Node.Level;
+	int32 step = GetSampleStep(Node.Level);
+	int32 num_samples = (width + 1) * (stride / step) + 1;
+	FIntPoint first = Node.Position * stride * (width - 1) + FIntPoint(1 - stride, 1 - stride);
+	int32 max_x = Map.GetWidthX() - 1;
+	int32 max_y = Map.GetWidthY() - 1;
+
+	Samples = FMapSection(num_samples, num_samples);
+	for (int32 y = 0; y < num_samples; ++y)
+	{
+		int32 map_y = FMath::Clamp(first.Y + y * step, 0, max_y);
+		for (int32 x = 0; x < num_samples; ++x)
+		{
+			int32 map_x = FMath::Clamp(first.X + x * step, 0, max_x);
+			Samples.Data[y * num_samples + x] = Map.GetHeight(map_x, map_y);
+		}
+	}
+}
+
+void UTerrainQuadtreeComponent::BuildNodeSection(const FMapSection& Samples, uint32 Size, FTerrainQuadtreeNode& Node)
+{
+	// The section has the same border as the samples, and takes every vertex on the node's own resolution
+	int32 width = GetTerrainComponentWidth(Size);
+	int32 ratio = (1 << Node.Level) / GetSampleStep(Node.Level);
+
+	TSharedPtr<FMapSection, ESPMode::ThreadSafe> section = MakeShareable(new FMapSection(width + 2, width + 2));
+	section->MinHeight = MAX_flt;
+	section->MaxHeight = -MAX_flt;
+	for (int32 y = 0; y < width + 2; ++y)
+	{
+		for (int32 x = 0; x < width + 2; ++x)
+		{
+			float height = Samples.Data[y * ratio * Samples.X + x * ratio];
+			section->Data[y * section->X + x] = height;
+
+			if (x > 0 && y > 0 && x <= width && y <= width)
+			{
+				section->MinHeight = FMath::Min(section->MinHeight, height);
+				section->MaxHeight = FMath::Max(section->MaxHeight, height);
+			}
+		}
+	}
+
+	// The section is replaced rather than modified, the proxy may still be reading the old one
+	Node.Section = section;
+}
+
+void UTerrainQuadtreeComponent::BuildNodeError(const FMapSection& Samples, uint32 Size, float ChildError, FTerrainQuadtreeNode& Node)
+{
+	if (Node.Level == 0)
+	{
+		// Level 0 nodes are drawn at full resolution
+		Node.Error = 0.0f;
+		return;
+	}
+
+	// The node at the resolution of its children starts after the two samples of its border
+	int32 width = GetTerrainComponentWidth(Size);
+	int32 fine_width = width * 2 - 1;
+
+	TArray<float> heights;
+	heights.SetNumUninitialized(fine_width * fine_width);
+	for (int32 y = 0; y < fine_width; ++y)
+	{
+		for (int32 x = 0; x < fine_width; ++x)
+		{
+			heights[y * fine_width + x] = Samples.Data[(y + 2) * Samples.X + x + 2];
+		}
+	}
+
+	// The distance to the full resolution surface is at most the children's distance plus the distance to the children
+	Node.Error = ChildError + GetHalfResolutionError(heights, fine_width);
+}
@@ -0,0 +1,429 @@
+#include "TerrainQuadtreeRender.h"
+#include "TerrainQuadtreeComponent.h"
+#include "TerrainMeshTemplate.h"
+#include "TerrainRender.h"
+#include "Terrain.h"
+#include "TerrainStat.h"
+
+#include "Engine.h"
+#include "SceneView.h"
+#include "Materials/Material.h"
+
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Select Quadtree Nodes"), STAT_DynamicTerrain_SelectNodes, STATGROUP_DynamicTerrain);
+
+/// Scene Proxy ///
+
+FTerrainQuadtreeSceneProxy::FTerrainQuadtreeSceneProxy(UTerrainQuadtreeComponent* Component) : FPrimitiveSceneProxy(Component), MaterialRelevance(Component->GetMaterialRelevance(GetScene().GetFeatureLevel()))
+{
+	// Get the layout of the quadtree from the component
+	Size = Component->Size;
+	ComponentCount = Component->ComponentCount;
+	LevelSizes = Component->LevelSizes;
+	LevelOffsets = Component->LevelOffsets;
+	MeshTemplate = Component->MeshTemplate;
+	LODErrorThreshold = Component->LODErrorThreshold;
+	ShadowLODBias = FMath::Max(Component->ShadowLODBias, 0);
+
+	// Get the material from the parent or use the engine default
+	// Terrain shaders are only compiled for materials used with landscapes, the editor sets the flag the first time it is checked
+	Material = Component->GetMaterial(0);
+	if (Material == nullptr || !Material->CheckMaterialUsage_Concurrent(MATUSAGE_Landscape))
+	{
+		Material = UMaterial::GetDefaultMaterial(MD_Surface);
+	}
+
+	// Initialize the nodes on the rendering thread, the nodes only share their map data with the component
+	TArray<FTerrainQuadtreeNode> nodes = Component->Nodes;
+	float tiling = Component->Tiling;
+	ENQUEUE_RENDER_COMMAND(FQuadtreeFillBuffers)([this, nodes, tiling](FRHICommandListImmediate& RHICmdList) {
+		Initialize(nodes, tiling);
+		});
+}
+
+FTerrainQuadtreeSceneProxy::~FTerrainQuadtreeSceneProxy()
+{
+	for (TUniquePtr<FNodeResources>& resources : NodeResources)
+	{
+		resources->HeightVertexBuffer.ReleaseResource();
+		resources->NormalVertexBuffer.ReleaseResource();
+		resources->MorphVertexBuffer.ReleaseResource();
+		resources->VertexFactory.ReleaseResource();
+	}
+
+	LODUniformBuffer.SafeRelease();
+}
+
+/// Scene Proxy Interface ///
+
+void FTerrainQuadtreeSceneProxy::GetDynamicMeshElements(const TArray< const FSceneView* >& Views, const FSceneViewFamily& ViewFamily, uint32 VisibilityMap, class FMeshElementCollector& Collector) const
+{
+	// Check to see if wireframe rendering is enabled
+	const bool wireframe = AllowDebugViewmodes() && ViewFamily.EngineShowFlags.Wireframe;
+
+	// Get the material proxy from either the current material or the wireframe material
+	FMaterialRenderProxy* material_proxy = nullptr;
+	if (wireframe)
+	{
+		// Get the wireframe material
+		FColoredMaterialRenderProxy* wireframe_material = new FColoredMaterialRenderProxy(GEngine->WireframeMaterial ? GEngine->WireframeMaterial->GetRenderProxy() : nullptr, FLinearColor(0.0f, 0.5f, 1.0f));
+		Collector.RegisterOneFrameMaterialProxy(wireframe_material);
+
+		material_proxy = wireframe_material;
+	}
+	else
+	{
+		material_proxy = Material->GetRenderProxy();
+	}
+
+	// Pass the selected nodes to every view the terrain is visible to
+	for (int32 view_index = 0; view_index < Views.Num(); ++view_index)
+	{
+		if (VisibilityMap & (1 << view_index))
+		{
+			const FSceneView* view = Views[view_index];
+
+			// Select the nodes for the view, shadow depth passes use coarser nodes
+			TArray<int32> nodes;
+			TArray<uint32> edges;
+			int32 bias = view->GetDynamicMeshElementsShadowCullFrustum() != nullptr ? ShadowLODBias : 0;
+			SelectNodes(GetLODView(*view), *view, bias, nodes, edges);
+
+			// Load uniform buffers, every node shares the terrain's primitive uniform buffer
+			bool bHasPrecomputedVolumetricLightmap;
+			FMatrix PreviousLocalToWorld;
+			int32 SingleCaptureIndex;
+			bool bOutputVelocity;
+			GetScene().GetPrimitiveUniformShaderParameters_RenderThread(GetPrimitiveSceneInfo(), bHasPrecomputedVolumetricLightmap, PreviousLocalToWorld, SingleCaptureIndex, bOutputVelocity);
+
+			FDynamicPrimitiveUniformBuffer& DynamicPrimitiveUniformBuffer = Collector.AllocateOneFrameResource<FDynamicPrimitiveUniformBuffer>();
+			DynamicPrimitiveUniformBuffer.Set(GetLocalToWorld(), PreviousLocalToWorld, GetBounds(), GetLocalBounds(), true, bHasPrecomputedVolumetricLightmap, DrawsVelocity(), bOutputVelocity);
+
+			for (int32 i = 0; i < nodes.Num(); ++i)
+			{
+				const FNodeResources& resources = *NodeResources[nodes[i]];
+
+				// Set up the mesh
+				FMeshBatch& mesh = Collector.AllocateMesh();
+				mesh.VertexFactory = &resources.VertexFactory;
+				mesh.MaterialRenderProxy = material_proxy;
+				mesh.ReverseCulling = IsLocalToWorldDeterminantNegative();
+				mesh.Type = PT_TriangleList;
+				mesh.DepthPriorityGroup = SDPG_World;
+				mesh.bCanApplyViewModeOverrides = false;
+				mesh.bWireframe = wireframe;
+				mesh.CastShadow = true;
+
+				// Nodes always use the full resolution grid of the template, stitched to coarser neighbours
+				FMeshBatchElement& element = mesh.Elements[0];
+				FTerrainIndexBuffer& index_buffer = IndexBuffers->GetBuffer(0, edges[i]);
+				element.IndexBuffer = &index_buffer;
+				element.FirstIndex = 0;
+				element.NumPrimitives = index_buffer.GetNumIndices() / 3;
+				element.MinVertexIndex = 0;
+				element.MaxVertexIndex = resources.HeightVertexBuffer.GetNumVertices() - 1;
+				element.UserData = &LODUniformBuffer;
+				element.PrimitiveUniformBufferResource = &DynamicPrimitiveUniformBuffer.UniformBuffer;
+
+				// Add the mesh
+				Collector.AddMesh(view_index, mesh);
+			}
+		}
+	}
+
+	// Draw bounds in debug builds
+#if !(UE_BUILD_SHIPPING || UE_BUILD_TEST)
+	for (int32 view_index = 0; view_index < Views.Num(); ++view_index)
+	{
+		if (VisibilityMap & (1 << view_index))
+		{
+			// Render the object bounds
+			RenderBounds(Collector.GetPDI(view_index), ViewFamily.EngineShowFlags, GetBounds(), IsSelected());
+		}
+	}
+#endif
+}
+
+FPrimitiveViewRelevance FTerrainQuadtreeSceneProxy::GetViewRelevance(const FSceneView* View) const
+{
+	FPrimitiveViewRelevance Result;
+	Result.bDrawRelevance = IsShown(View);
+	Result.bShadowRelevance = IsShadowCast(View);
+
+	// The selected nodes change with every view, so the quadtree is always drawn dynamically
+	Result.bDynamicRelevance = true;
+	Result.bStaticRelevance = false;
+
+	Result.bRenderInMainPass = ShouldRenderInMainPass();
+	Result.bUsesLightingChannels = GetLightingChannelMask() != GetDefaultLightingChannelMask();
+	Result.bRenderCustomDepth = ShouldRenderCustomDepth();
+
+	Result.bTranslucentSelfShadow = bCastVolumetricTranslucentShadow;
+	MaterialRelevance.SetPrimitiveViewRelevance(Result);
+	Result.bVelocityRelevance = IsMovable() && Result.bOpaque && Result.bRenderInMainPass;
+	return Result;
+}
+
+/// Proxy Update Functions ///
+
+void FTerrainQuadtreeSceneProxy::UpdateNodes(const TArray<int32>& Indices, const TArray<FTerrainQuadtreeNode>& NewNodes)
+{
+	for (int32 i = 0; i < Indices.Num(); ++i)
+	{
+		// Ignore nodes from a different layout
+		if (NodeResources.IsValidIndex(Indices[i]))
+		{
+			UpdateNodeData(*NodeResources[Indices[i]], NewNodes[i]);
+		}
+	}
+}
+
+void FTerrainQuadtreeSceneProxy::UpdateLODErrorThreshold(float Pixels)
+{
+	LODErrorThreshold = Pixels;
+}
+
+void FTerrainQuadtreeSceneProxy::UpdateShadowLODBias(int32 Bias)
+{
+	ShadowLODBias = FMath::Max(Bias, 0);
+}
+
+void FTerrainQuadtreeSceneProxy::UpdateTiling(float Tiling)
+{
+	// Node positions already include their offset in the terrain, so the UVs only need the tiling
+	for (TUniquePtr<FNodeResources>& resources : NodeResources)
+	{
+		resources->VertexFactory.SetUVParameters(FVector2D::ZeroVector, Tiling);
+	}
+}
+
+void FTerrainQuadtreeSceneProxy::Initialize(const TArray<FTerrainQuadtreeNode>& Nodes, float Tiling)
+{
+	IndexBuffers = FTerrainSharedIndexBuffers::Get(*MeshTemplate);
+
+	// No vertex has this level, so nothing morphs
+	FTerrainLODParameters parameters;
+	parameters.MorphParameters = FVector4(32.0f, 0.0f, 0.0f, 0.0f);
+	LODUniformBuffer = TUniformBufferRef<FTerrainLODParameters>::CreateUniformBufferImmediate(parameters, UniformBuffer_MultiFrame);
+
+	uint32 width = MeshTemplate->Width;
+	NodeResources.SetNum(Nodes.Num());
+	for (int32 i = 0; i < Nodes.Num(); ++i)
+	{
+		const FTerrainQuadtreeNode& node = Nodes[i];
+		NodeResources[i] = MakeUnique<FNodeResources>(GetScene().GetFeatureLevel());
+		FNodeResources& resources = *NodeResources[i];
+
+		// Initialize the buffers
+		resources.HeightVertexBuffer.Init(width * width);
+		resources.NormalVertexBuffer.Init(width * width);
+		resources.MorphVertexBuffer.Init(width * width);
+		resources.HeightVertexBuffer.InitResource();
+		resources.NormalVertexBuffer.InitResource();
+		resources.MorphVertexBuffer.InitResource();
+		UpdateNodeData(resources, node);
+
+		// Bind vertex factory data
+		FTerrainVertexFactory::FDataType datatype;
+		datatype.HeightComponent = FVertexStreamComponent(&resources.HeightVertexBuffer, 0, sizeof(float), VET_Float1);
+		datatype.NormalComponent = FVertexStreamComponent(&resources.NormalVertexBuffer, 0, sizeof(FTerrainNormalVertex), VET_Short2N);
+		datatype.MorphHeightComponent = FVertexStreamComponent(&resources.MorphVertexBuffer, 0, sizeof(float), VET_Float1);
+
+		// The node's grid is spread over all the components it covers
+		float spacing = 1 << node.Level;
+		FVector2D offset = FVector2D(node.Position) * spacing * (width - 1);
+		resources.VertexFactory.SetData(datatype);
+		resources.VertexFactory.SetGridParameters(width, spacing, offset);
+		resources.VertexFactory.SetUVParameters(FVector2D::ZeroVector, Tiling);
+		resources.VertexFactory.InitResource();
+	}
+}
+
+void FTerrainQuadtreeSceneProxy::UpdateNodeData(FNodeResources& Resources, const FTerrainQuadtreeNode& Node)
+{
+	// Vertex data is written straight into the RHI buffers, sections of coarser levels have vertices further apart
+	float spacing = 1 << Node.Level;
+	FTerrainComponentSceneProxy::BuildVertices(*Node.Section, *MeshTemplate, Resources.HeightVertexBuffer.Lock(), Resources.NormalVertexBuffer.Lock(), Resources.MorphVertexBuffer.Lock(), spacing);
+
+	Resources.HeightVertexBuffer.Unlock();
+	Resources.NormalVertexBuffer.Unlock();
+	Resources.MorphVertexBuffer.Unlock();
+
+	FVector offset = FVector(FVector2D(Node.Position) * spacing * (MeshTemplate->Width - 1), 0.0f);
+	float extent = spacing * (MeshTemplate->Width - 1);
+	Resources.Bounds = FBox(offset + FVector(0.0f, 0.0f, Node.Section->MinHeight), offset + FVector(extent, extent, Node.Section->MaxHeight));
+	Resources.Error = Node.Error;
+}
+
+/// Node Selection ///
+
+void FTerrainQuadtreeSceneProxy::SelectNodes(const FSceneView& LODView, const FSceneView& CullView, int32 LODBias, TArray<int32>& OutNodes, TArray<uint32>& OutEdgeMasks) const
+{
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_SelectNodes);
+
+	// Get the number of pixels a unit of local height covers at a distance of one unit
+	FCachedSystemScalabilityCVars cvars = GetCachedScalabilityCVars();
+	float screen_scale = cvars.StaticMeshLODDistanceScale != 0.0f ? 1.0f / cvars.StaticMeshLODDistanceScale : 1.0f;
+	const FMatrix& projection = LODView.ViewMatrices.GetProjectionMatrix();
+	float pixel_scale = 0.5f * FMath::Max(projection.M[0][0] * LODView.UnconstrainedViewRect.Width(), projection.M[1][1] * LODView.UnconstrainedViewRect.Height());
+	pixel_scale *= FMath::Abs(GetLocalToWorld().GetScaleVector().Z) * screen_scale * LODView.LODDistanceFactor;
+	pixel_scale /= (float)(1 << FMath::Min(LODBias, 16));
+
+	// Select nodes from the top of the tree, the root may stick out of the terrain if it isn't a square power of two
+	TSet<FIntVector> leaves;
+	int32 root = FMath::CeilLogTwo(FMath::Max(ComponentCount.X, ComponentCount.Y));
+	SelectNode(root, 0, 0, LODView, CullView, pixel_scale, leaves);
+
+	// Split nodes until no node borders one more than a level finer, so every edge can be stitched
+	// A node whose neighbour is finer or outside of the view leaves the check to the other side
+	static const FIntPoint neighbours[4] = { FIntPoint(-1, 0), FIntPoint(1, 0), FIntPoint(0, -1), FIntPoint(0, 1) };
+	TArray<FIntVector> pending = leaves.Array();
+	while (pending.Num() > 0)
+	{
+		FIntVector leaf = pending.Pop(false);
+		if (!leaves.Contains(leaf))
+		{
+			continue;
+		}
+
+		for (const FIntPoint& offset : neighbours)
+		{
+			int32 level = FindLeafLevel(leaf.Z, leaf.X + offset.X, leaf.Y + offset.Y, leaves);
+			if (level == INDEX_NONE || level <= leaf.Z + 1)
+			{
+				continue;
+			}
+
+			// Replace the neighbour's node with its children, which always exist because the neighbour does
+			int32 shift = level - leaf.Z;
+			FIntVector coarse((leaf.X + offset.X) >> shift, (leaf.Y + offset.Y) >> shift, level);
+			leaves.Remove(coarse);
+			for (int32 child = 0; child < 4; ++child)
+			{
+				FIntVector child_leaf(coarse.X * 2 + (child & 1), coarse.Y * 2 + (child >> 1), level - 1);
+				int32 index = GetNodeIndex(child_leaf.Z, child_leaf.X, child_leaf.Y);
+				check(index != INDEX_NONE);
+				if (IsNodeVisible(index, CullView))
+				{
+					leaves.Add(child_leaf);
+					pending.Add(child_leaf);
+				}
+			}
+
+			// The neighbour may still be too coarse, so check this node again
+			pending.Add(leaf);
+			break;
+		}
+	}
+
+	// Stitch the edges that border a coarser node
+	OutNodes.Empty(leaves.Num());
+	OutEdgeMasks.Empty(leaves.Num());
+	static const uint32 edge_flags[4] = { ETerrainEdge::NegativeX, ETerrainEdge::PositiveX, ETerrainEdge::NegativeY, ETerrainEdge::PositiveY };
+	for (const FIntVector& leaf : leaves)
+	{
+		uint32 edges = 0;
+		for (int32 i = 0; i < 4; ++i)
+		{
+			if (FindLeafLevel(leaf.Z, leaf.X + neighbours[i].X, leaf.Y + neighbours[i].Y, leaves) == leaf.Z + 1)
+			{
+				edges |= edge_flags[i];
+			}
+		}
+
+		int32 index = GetNodeIndex(leaf.Z, leaf.X, leaf.Y);
+		check(index != INDEX_NONE);
+		OutNodes.Add(index);
+		OutEdgeMasks.Add(edges);
+	}
+}
+
+void FTerrainQuadtreeSceneProxy::SelectNode(int32 Level, int32 X, int32 Y, const FSceneView& LODView, const FSceneView& CullView, float PixelScale, TSet<FIntVector>& Leaves) const
+{
+	// Skip nodes that are completely outside of the terrain
+	int32 span = 1 << Level;
+	if (X * span >= ComponentCount.X || Y * span >= ComponentCount.Y)
+	{
+		return;
+	}
+
+	// Nodes that stick out of the terrain don't exist, so they are always split
+	int32 index = GetNodeIndex(Level, X, Y);
+	bool split = index == INDEX_NONE;
+	if (!split)
+	{
+		// Nothing under a node outside of the view can be visible
+		if (!IsNodeVisible(index, CullView))
+		{
+			return;
+		}
+
+		if (Level > 0)
+		{
+			// Find the distance to the nearest point of the node
+			float distance = 1.0f;
+			if (LODView.IsPerspectiveProjection())
+			{
+				FBox bounds = NodeResources[index]->Bounds.TransformBy(GetLocalToWorld());
+				distance = FMath::Max(FMath::Sqrt(bounds.ComputeSquaredDistanceToPoint(LODView.ViewMatrices.GetViewOrigin())), 1.0f);
+			}
+
+			split = NodeResources[index]->Error * PixelScale / distance > LODErrorThreshold;
+		}
+	}
+
+	if (split)
+	{
+		check(Level > 0);
+		SelectNode(Level - 1, X * 2, Y * 2, LODView, CullView, PixelScale, Leaves);
+		SelectNode(Level - 1, X * 2 + 1, Y * 2, LODView, CullView, PixelScale, Leaves);
+		SelectNode(Level - 1, X * 2, Y * 2 + 1, LODView, CullView, PixelScale, Leaves);
+		SelectNode(Level - 1, X * 2 + 1, Y * 2 + 1, LODView, CullView, PixelScale, Leaves);
+		return;
+	}
+
+	Leaves.Add(FIntVector(X, Y, Level));
+}
+
+bool FTerrainQuadtreeSceneProxy::IsNodeVisible(int32 Index, const FSceneView& View) const
+{
+	FBox bounds = NodeResources[Index]->Bounds.TransformBy(GetLocalToWorld());
+
+	// Shadow casters are culled in the translated space of the shadow
+	const FConvexVolume* shadow_frustum = View.GetDynamicMeshElementsShadowCullFrustum();
+	if (shadow_frustum != nullptr)
+	{
+		return shadow_frustum->IntersectBox(bounds.GetCenter() + View.GetPreShadowTranslation(), bounds.GetExtent());
+	}
+
+	return View.ViewFrustum.IntersectBox(bounds.GetCenter(), bounds.GetExtent());
+}
+
+int32 FTerrainQuadtreeSceneProxy::FindLeafLevel(int32 Level, int32 X, int32 Y, const TSet<FIntVector>& Leaves) const
+{
+	if (X < 0 || Y < 0)
+	{
+		return INDEX_NONE;
+	}
+
+	// Only the node itself or one of its parents can cover the whole position
+	for (int32 level = Level; level < LevelSizes.Num(); ++level)
+	{
+		int32 shift = level - Level;
+		if (Leaves.Contains(FIntVector(X >> shift, Y >> shift, level)))
+		{
+			return level;
+		}
+	}
+
+	return INDEX_NONE;
+}
+
+int32 FTerrainQuadtreeSceneProxy::GetNodeIndex(int32 Level, int32 X, int32 Y) const
+{
+	if (Level < 0 || Level >= LevelSizes.Num() || X < 0 || Y < 0 || X >= LevelSizes[Level].X || Y >= LevelSizes[Level].Y)
+	{
+		return INDEX_NONE;
+	}
+
+	return LevelOffsets[Level] + Y * LevelSizes[Level].X + X;
+}
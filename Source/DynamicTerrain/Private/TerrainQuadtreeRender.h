@@ -0,0 +1,124 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "PrimitiveSceneProxy.h"
+
+#include "TerrainVertexFactory.h"
+
+class UTerrainQuadtreeComponent;
+class FTerrainMeshTemplate;
+class FTerrainSharedIndexBuffers;
+struct FTerrainQuadtreeNode;
+
+// A rendering proxy which draws a whole terrain as a quadtree of nodes
+// Each view selects the coarsest nodes whose projected error stays under the threshold, and neighbouring nodes never
+// differ by more than one level so their edges can be stitched with the mesh template's edge variants
+// Functions for the proxy should only be called on the rendering thread (with the exception of the constructor)
+class FTerrainQuadtreeSceneProxy : public FPrimitiveSceneProxy
+{
+public:
+	FTerrainQuadtreeSceneProxy(UTerrainQuadtreeComponent* Component);
+	virtual ~FTerrainQuadtreeSceneProxy();
+
+	/// Scene Proxy Interface ///
+
+	SIZE_T GetTypeHash() const override
+	{
+		static size_t unique_pointer;
+		return reinterpret_cast<size_t>(&unique_pointer);
+	}
+
+	virtual uint32 GetMemoryFootprint() const override
+	{
+		return (sizeof(*this) + GetAllocatedSize());
+	}
+
+	uint32 GetAllocatedSize() const
+	{
+		// Index buffers are shared with the components, and GPU buffers are counted by the memory stats
+		return(FPrimitiveSceneProxy::GetAllocatedSize() + LevelSizes.GetAllocatedSize() + LevelOffsets.GetAllocatedSize() + NodeResources.GetAllocatedSize() + NodeResources.Num() * sizeof(FNodeResources));
+	}
+
+	virtual bool CanBeOccluded() const override
+	{
+		// The proxy covers the entire terrain, so it is almost never occluded as a whole
+		return false;
+	}
+
+	virtual void GetDynamicMeshElements(const TArray< const FSceneView* >& Views, const FSceneViewFamily& ViewFamily, uint32 VisibilityMap, class FMeshElementCollector& Collector) const override;
+	virtual FPrimitiveViewRelevance GetViewRelevance(const FSceneView* View) const override;
+
+	/// Proxy Update Functions ///
+
+	// Replace the map data of some nodes
+	void UpdateNodes(const TArray<int32>& Indices, const TArray<FTerrainQuadtreeNode>& NewNodes);
+	// Change the largest error in pixels a node can show on screen
+	void UpdateLODErrorThreshold(float Pixels);
+	// Change the number of levels coarser than the main view that whole scene shadows use
+	void UpdateShadowLODBias(int32 Bias);
+	// Update UV tiling, this only changes shader parameters
+	void UpdateTiling(float Tiling);
+
+protected:
+	// The GPU resources of a single node
+	struct FNodeResources
+	{
+		FNodeResources(ERHIFeatureLevel::Type FeatureLevel) : VertexFactory(FeatureLevel) {}
+
+		TTerrainVertexBuffer<float> HeightVertexBuffer;
+		TTerrainVertexBuffer<FTerrainNormalVertex> NormalVertexBuffer;
+		TTerrainVertexBuffer<float> MorphVertexBuffer;
+		FTerrainVertexFactory VertexFactory;
+
+		// The local bounds of the node
+		FBox Bounds;
+		// The largest vertical distance between the node and the full resolution surface, in local space
+		float Error = 0.0f;
+	};
+
+	// Create the resources for every node
+	void Initialize(const TArray<FTerrainQuadtreeNode>& Nodes, float Tiling);
+	// Write the map data of a node into its vertex buffers
+	void UpdateNodeData(FNodeResources& Resources, const FTerrainQuadtreeNode& Node);
+
+	// Select the nodes to draw for a view and the edges of each node that need to be stitched
+	// LODView picks the detail of each node, CullView rejects nodes outside of its frustum
+	// Each level of bias doubles the error a node can show on screen
+	void SelectNodes(const FSceneView& LODView, const FSceneView& CullView, int32 LODBias, TArray<int32>& OutNodes, TArray<uint32>& OutEdgeMasks) const;
+	// Select a node if it is detailed enough for the view, otherwise select its children
+	// Nodes outside of the view are skipped with their whole subtree, Leaves holds the position and level of each selected node
+	void SelectNode(int32 Level, int32 X, int32 Y, const FSceneView& LODView, const FSceneView& CullView, float PixelScale, TSet<FIntVector>& Leaves) const;
+	// Check whether a node is inside the frustum of a view, shadow views use the frustum of their shadow casters
+	bool IsNodeVisible(int32 Index, const FSceneView& View) const;
+	// Get the level of the selected node covering a position of the given level, or INDEX_NONE if nothing there is selected
+	int32 FindLeafLevel(int32 Level, int32 X, int32 Y, const TSet<FIntVector>& Leaves) const;
+	// Get the index of a node, or INDEX_NONE if the node is not completely inside the terrain
+	int32 GetNodeIndex(int32 Level, int32 X, int32 Y) const;
+
+	// The size of the terrain's components, every node has the same number of vertices as a component
+	uint32 Size;
+	// The number of components on each axis
+	FIntPoint ComponentCount;
+	// The number of nodes on each axis of each level
+	TArray<FIntPoint> LevelSizes;
+	// The index of the first node of each level
+	TArray<int32> LevelOffsets;
+	// The resources of every node, ordered like the component's nodes
+	TArray<TUniquePtr<FNodeResources>> NodeResources;
+
+	// The mesh topology shared with the terrain's components
+	TSharedPtr<const FTerrainMeshTemplate, ESPMode::ThreadSafe> MeshTemplate;
+	// The triangles used by each node, only LOD 0 and its edge variants are used
+	TSharedPtr<FTerrainSharedIndexBuffers> IndexBuffers;
+	// Morph parameters shared by every node, nodes always draw their full resolution grid so they never morph
+	TUniformBufferRef<FTerrainLODParameters> LODUniformBuffer;
+
+	// The material used to render the terrain
+	UMaterialInterface* Material;
+	FMaterialRelevance MaterialRelevance;
+
+	// The largest error in pixels a node can show on screen
+	float LODErrorThreshold;
+	// The number of levels coarser than the main view that whole scene shadows use
+	int32 ShadowLODBias;
+};
@@ -1,29 +1,125 @@
 #include "TerrainRender.h"
 #include "TerrainComponent.h"
+#include "TerrainMeshTemplate.h"
 #include "Terrain.h"
+#include "TerrainRenderState.h"
+#include "TerrainStat.h"
 
 #include "Engine.h"
 #include "SceneView.h"
 #include "Materials/Material.h"
+#include "Async/ParallelFor.h"
+#include "Misc/ScopeLock.h"
 
-FTerrainComponentSceneProxy::FTerrainComponentSceneProxy(UTerrainComponent* Component) : FPrimitiveSceneProxy(Component), VertexFactory(GetScene().GetFeatureLevel(), "FTerrainComponentSceneProxy"), MaterialRelevance(Component->GetMaterialRelevance(GetScene().GetFeatureLevel()))
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Build Vertices"), STAT_DynamicTerrain_BuildVertices, STATGROUP_DynamicTerrain);
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Build Adaptive Triangulation"), STAT_DynamicTerrain_BuildAdaptive, STATGROUP_DynamicTerrain);
+
+// A component only switches to a coarser LOD once that LOD's projected error is this fraction of the threshold
+static const float TerrainLODHysteresis = 0.8f;
+
+/// Shared Index Buffers ///
+
+FCriticalSection FTerrainSharedIndexBuffers::MemoryLock;
+TMap<uint32, uint32> FTerrainSharedIndexBuffers::VideoMemory;
+
+TSharedRef<FTerrainSharedIndexBuffers> FTerrainSharedIndexBuffers::Get(const FTerrainMeshTemplate& Template)
+{
+	check(IsInRenderingThread());
+
+	static TMap<uint32, TWeakPtr<FTerrainSharedIndexBuffers>> cache;
+	if (TWeakPtr<FTerrainSharedIndexBuffers>* existing = cache.Find(Template.Size))
+	{
+		TSharedPtr<FTerrainSharedIndexBuffers> buffers = existing->Pin();
+		if (buffers.IsValid())
+		{
+			return buffers.ToSharedRef();
+		}
+	}
+
+	// Create GPU buffers for each LOD and edge variant in the template
+	TSharedRef<FTerrainSharedIndexBuffers> buffers = MakeShareable(new FTerrainSharedIndexBuffers());
+	buffers->Size = Template.Size;
+	buffers->Buffers.SetNum(Template.GetNumLODs() * FTerrainMeshTemplate::NumEdgeVariants);
+	uint32 memory = 0;
+	TArray<uint32> indices;
+	for (int32 i = 0; i < Template.GetNumLODs(); ++i)
+	{
+		for (uint32 mask = 0; mask < FTerrainMeshTemplate::NumEdgeVariants; ++mask)
+		{
+			Template.GetStitchedIndices(i, mask, indices);
+			FTerrainIndexBuffer& buffer = buffers->GetBuffer(i, mask);
+			buffer.SetIndices(indices, Template.Width * Template.Width);
+			buffer.InitResource();
+			memory += buffer.GetVideoMemorySize();
+		}
+	}
+
+	cache.Add(Template.Size, buffers);
+	FScopeLock lock(&MemoryLock);
+	VideoMemory.Add(Template.Size, memory);
+	return buffers;
+}
+
+FTerrainSharedIndexBuffers::~FTerrainSharedIndexBuffers()
+{
+	for (int32 i = 0; i < Buffers.Num(); ++i)
+	{
+		Buffers[i].ReleaseResource();
+	}
+
+	FScopeLock lock(&MemoryLock);
+	VideoMemory.Remove(Size);
+}
+
+uint32 FTerrainSharedIndexBuffers::GetVideoMemorySize(uint32 ComponentSize)
+{
+	FScopeLock lock(&MemoryLock);
+	const uint32* memory = VideoMemory.Find(ComponentSize);
+	return memory != nullptr ? *memory : 0;
+}
+
+FTerrainIndexBuffer& FTerrainSharedIndexBuffers::GetBuffer(uint32 LOD, uint32 EdgeMask)
+{
+	return Buffers[LOD * FTerrainMeshTemplate::NumEdgeVariants + EdgeMask];
+}
+
+/// Scene Proxy ///
+
+FTerrainComponentSceneProxy::FTerrainComponentSceneProxy(UTerrainComponent* Component) : FPrimitiveSceneProxy(Component), VertexFactory(GetScene().GetFeatureLevel()), MaterialRelevance(Component->GetMaterialRelevance(GetScene().GetFeatureLevel()))
 {
 	// Get map data from the parent component
 	MapProxy = Component->GetMapProxy();
+	MeshTemplate = Component->GetMeshTemplate();
 	Size = Component->Size;
-	MaxLOD = Component->LODs;
-	
-	// Create LOD indices
+	MaxLOD = FMath::Min<uint32>(Component->LODs, MeshTemplate->GetNumLODs());
+	// Mesh batches store their LOD and edge variant in a signed byte, and MAX_int8 marks components hidden behind the horizon
+	MaxLOD = FMath::Min<uint32>(MaxLOD, MAX_int8 / FTerrainMeshTemplate::NumEdgeVariants);
 	ScaleLODs(Component->LODScale);
-	IndexBuffers.SetNum(MaxLOD);
-	for (uint32 i = 0; i < MaxLOD; ++i)
+	LODErrorThreshold = Component->LODErrorThreshold;
+	ShadowLODBias = FMath::Max(Component->ShadowLODBias, 0);
+	Adaptive = Component->AdaptiveTriangulation;
+	AdaptiveErrorThreshold = Component->AdaptiveErrorThreshold;
+	GridPosition = FIntPoint(Component->XOffset, Component->YOffset);
+	VideoMemory = Component->VideoMemory;
+
+	// Share LOD selection with the rest of the terrain, components outside of a terrain select LODs on their own
+	ATerrain* terrain = Cast<ATerrain>(Component->GetOwner());
+	RenderState = terrain != nullptr ? terrain->GetRenderState() : MakeShareable(new FTerrainRenderState());
+
+	// Only edges that can border another component of the terrain are ever stitched
+	StitchedEdges = 0;
+	if (terrain != nullptr)
 	{
-		UpdateIndexData(IndexBuffers[i].Indices, i);
+		StitchedEdges |= GridPosition.X > 0 ? ETerrainEdge::NegativeX : 0;
+		StitchedEdges |= GridPosition.X < terrain->GetXWidth() - 1 ? ETerrainEdge::PositiveX : 0;
+		StitchedEdges |= GridPosition.Y > 0 ? ETerrainEdge::NegativeY : 0;
+		StitchedEdges |= GridPosition.Y < terrain->GetYWidth() - 1 ? ETerrainEdge::PositiveY : 0;
 	}
 
 	// Get the material from the parent or use the engine default
+	// Terrain shaders are only compiled for materials used with landscapes, the editor sets the flag the first time it is checked
 	Material = Component->GetMaterial(0);
-	if (Material == nullptr)
+	if (Material == nullptr || !Material->CheckMaterialUsage_Concurrent(MATUSAGE_Landscape))
 	{
 		Material = UMaterial::GetDefaultMaterial(MD_Surface);
 	}
@@ -40,17 +136,125 @@ FTerrainComponentSceneProxy::FTerrainComponentSceneProxy(UTerrainComponent* Comp
 
 FTerrainComponentSceneProxy::~FTerrainComponentSceneProxy()
 {
-	VertexBuffers.PositionVertexBuffer.ReleaseResource();
-	VertexBuffers.StaticMeshVertexBuffer.ReleaseResource();
+	RenderState->RemoveProxy(this, GridPosition);
+	VideoMemory->Set(0);
+
+	HeightVertexBuffer.ReleaseResource();
+	NormalVertexBuffer.ReleaseResource();
+	MorphVertexBuffer.ReleaseResource();
 	VertexFactory.ReleaseResource();
-	for (int32 i = 0; i < IndexBuffers.Num(); ++i)
+
+	for (FTerrainIndexBuffer& buffer : AdaptiveIndexBuffers)
+	{
+		buffer.ReleaseResource();
+	}
+	for (TUniformBufferRef<FTerrainLODParameters>& buffer : LODUniformBuffers)
 	{
-		IndexBuffers[i].ReleaseResource();
+		buffer.SafeRelease();
 	}
 }
 
 /// Scene Proxy Interface ///
 
+uint32 FTerrainComponentSceneProxy::GetAllocatedSize() const
+{
+	uint32 size = FPrimitiveSceneProxy::GetAllocatedSize();
+	size += LODScales.GetAllocatedSize() + LODErrors.GetAllocatedSize() + LODUniformBuffers.GetAllocatedSize();
+	size += AdaptiveIndexBuffers.GetAllocatedSize();
+	for (const FTerrainIndexBuffer& buffer : AdaptiveIndexBuffers)
+	{
+		size += buffer.GetAllocatedSize();
+	}
+	return size;
+}
+
+FLODMask FTerrainComponentSceneProxy::GetCustomLOD(const FSceneView& InView, float InViewLODScale, int32 InForcedLODLevel, float& OutScreenSizeSquared) const
+{
+	const FBoxSphereBounds& bounds = GetBounds();
+	OutScreenSizeSquared = ComputeBoundsScreenRadiusSquared(bounds.Origin, bounds.SphereRadius, InView);
+
+	uint32 LOD = 0;
+	uint32 edges = 0;
+	if (InForcedLODLevel >= 0)
+	{
+		LOD = FMath::Min<int32>(InForcedLODLevel, MaxLOD - 1);
+	}
+	else
+	{
+		// Components hidden behind the terrain select an LOD that has no batch
+		if (RenderState->IsOccluded(InView, InViewLODScale, GridPosition))
+		{
+			return FLODMask();
+		}
+		SelectLOD(InView, InViewLODScale, LOD, edges);
+	}
+
+	// Static batches are registered with both the LOD and the edge variant
+	FLODMask mask;
+	mask.SetLOD(LOD * FTerrainMeshTemplate::NumEdgeVariants + edges);
+	return mask;
+}
+
+FLODMask FTerrainComponentSceneProxy::GetCustomWholeSceneShadowLOD(const FSceneView& InView, float InViewLODScale, int32 InForcedLODLevel, const FLODMask& InVisibilePrimitiveLODMask, float InShadowMapTextureResolution, float InShadowMapCascadeSize, int8 InShadowCascadeId, bool InHasSelfShadow) const
+{
+	// Start from the batch the main view draws, components that it doesn't see select their LOD the same way it would
+	// Components hidden behind the horizon can still cast visible shadows, so they are never culled here
+	uint32 LOD = 0;
+	uint32 edges = 0;
+	int8 view_lod = InVisibilePrimitiveLODMask.DitheredLODIndices[0];
+	if (view_lod != MAX_int8)
+	{
+		LOD = view_lod / FTerrainMeshTemplate::NumEdgeVariants;
+		edges = view_lod % FTerrainMeshTemplate::NumEdgeVariants;
+	}
+	else if (InForcedLODLevel >= 0)
+	{
+		LOD = FMath::Min<int32>(InForcedLODLevel, MaxLOD - 1);
+	}
+	else
+	{
+		SelectLOD(InView, InViewLODScale, LOD, edges);
+	}
+
+	if (InForcedLODLevel < 0)
+	{
+		ApplyShadowLODBias(LOD, edges);
+	}
+
+	FLODMask mask;
+	mask.SetLOD(LOD * FTerrainMeshTemplate::NumEdgeVariants + edges);
+	return mask;
+}
+
+void FTerrainComponentSceneProxy::DrawStaticElements(FStaticPrimitiveDrawInterface* PDI)
+{
+	// Adaptive triangulations are drawn dynamically
+	if (Adaptive)
+	{
+		return;
+	}
+
+	// Register a batch for each LOD and edge variant, GetCustomLOD picks one per view and the renderer caches its draw commands
+	// Edits update the buffers in place, so the cached commands stay valid
+	// The stitched edges depend on the neighbours' LODs in each view, so they can't be resolved to one batch per LOD without
+	// drawing dynamically, but variants are only registered for edges with a neighbour and never for the last LOD, which
+	// has no coarser neighbours. Each variant only costs its cached draw commands, nothing is done for it per frame
+	for (uint32 i = 0; i < MaxLOD; ++i)
+	{
+		for (uint32 edges = 0; edges < FTerrainMeshTemplate::NumEdgeVariants; ++edges)
+		{
+			if ((edges & ~StitchedEdges) != 0 || (edges != 0 && i == MaxLOD - 1))
+			{
+				continue;
+			}
+
+			FMeshBatch mesh;
+			GetMeshBatch(i, edges, Material->GetRenderProxy(), mesh);
+			PDI->DrawMesh(mesh, LODScales[i]);
+		}
+	}
+}
+
 void FTerrainComponentSceneProxy::GetDynamicMeshElements(const TArray< const FSceneView* >& Views, const FSceneViewFamily& ViewFamily, uint32 VisibilityMap, class FMeshElementCollector& Collector) const
 {
 	// Check to see if wireframe rendering is enabled
@@ -78,44 +282,27 @@ void FTerrainComponentSceneProxy::GetDynamicMeshElements(const TArray< const FSc
 		{
 			const FSceneView* view = Views[view_index];
 
-			// Get the LOD index of the mesh
+			// Get the LOD index of the mesh, skipping components hidden behind the terrain unless they cast a shadow
 			const FSceneView& lod_view = GetLODView(*view);
-			const FBoxSphereBounds bounds = GetBounds();
-
-			FCachedSystemScalabilityCVars cvars = GetCachedScalabilityCVars();
-			float screen_scale = cvars.StaticMeshLODDistanceScale != 0.0f ? 1.0f / cvars.StaticMeshLODDistanceScale : 1.0f;
+			bool shadow = view->GetDynamicMeshElementsShadowCullFrustum() != nullptr;
+			if (!shadow && RenderState->IsOccluded(lod_view, lod_view.LODDistanceFactor, GridPosition))
+			{
+				continue;
+			}
 
 			uint32 LOD = 0;
-			float radius = ComputeBoundsScreenRadiusSquared(bounds.Origin, bounds.SphereRadius, *view) * screen_scale * screen_scale * lod_view.LODDistanceFactor * lod_view.LODDistanceFactor;
-			for (uint32 i = 0; i < MaxLOD; ++i)
+			uint32 edges = 0;
+			SelectLOD(lod_view, lod_view.LODDistanceFactor, LOD, edges);
+			if (shadow)
 			{
-				if (FMath::Square(LODScales[i] * 0.5) > radius)
-				{
-					LOD = i;
-				}
-				else
-				{
-					break;
-				}
+				ApplyShadowLODBias(LOD, edges);
 			}
 
 			// Set up the mesh
 			FMeshBatch& mesh = Collector.AllocateMesh();
+			GetMeshBatch(LOD, edges, material_proxy, mesh);
 			mesh.bWireframe = wireframe;
-			mesh.VertexFactory = &VertexFactory;
-			mesh.MaterialRenderProxy = material_proxy;
-			mesh.ReverseCulling = IsLocalToWorldDeterminantNegative();
-			mesh.Type = PT_TriangleList;
-			mesh.DepthPriorityGroup = SDPG_World;
-			mesh.bCanApplyViewModeOverrides = false;
-
-			// Set up the first element of the mesh (we only need one)
 			FMeshBatchElement& element = mesh.Elements[0];
-			element.IndexBuffer = &IndexBuffers[LOD];
-			element.FirstIndex = 0;
-			element.NumPrimitives = IndexBuffers[LOD].Indices.Num() / 3;
-			element.MinVertexIndex = 0;
-			element.MaxVertexIndex = VertexBuffers.PositionVertexBuffer.GetNumVertices() - 1;
 
 			// Load uniform buffers
 			bool bHasPrecomputedVolumetricLightmap;
@@ -152,7 +339,10 @@ FPrimitiveViewRelevance FTerrainComponentSceneProxy::GetViewRelevance(const FSce
 	Result.bDrawRelevance = IsShown(View);
 	Result.bShadowRelevance = IsShadowCast(View);
 
-	Result.bDynamicRelevance = true;
+	// The cached static path is used unless the view needs debug drawing, or the triangles change with every edit
+	const bool dynamic = Adaptive || (AllowDebugViewmodes() && View->Family->EngineShowFlags.Wireframe) || View->Family->EngineShowFlags.Bounds;
+	Result.bDynamicRelevance = dynamic;
+	Result.bStaticRelevance = !dynamic;
 
 	Result.bRenderInMainPass = ShouldRenderInMainPass();
 	Result.bUsesLightingChannels = GetLightingChannelMask() != GetDefaultLightingChannelMask();
@@ -164,155 +354,374 @@ FPrimitiveViewRelevance FTerrainComponentSceneProxy::GetViewRelevance(const FSce
 	return Result;
 }
 
+void FTerrainComponentSceneProxy::GetMeshBatch(uint32 LOD, uint32 EdgeMask, const FMaterialRenderProxy* MaterialProxy, FMeshBatch& OutMesh) const
+{
+	OutMesh.VertexFactory = &VertexFactory;
+	OutMesh.MaterialRenderProxy = MaterialProxy;
+	OutMesh.ReverseCulling = IsLocalToWorldDeterminantNegative();
+	OutMesh.Type = PT_TriangleList;
+	OutMesh.DepthPriorityGroup = SDPG_World;
+	OutMesh.bCanApplyViewModeOverrides = false;
+	OutMesh.LODIndex = LOD * FTerrainMeshTemplate::NumEdgeVariants + EdgeMask;
+	OutMesh.CastShadow = true;
+
+	// Set up the first element of the mesh (we only need one)
+	// Adaptive triangulations keep every edge vertex, so they never need stitching
+	FMeshBatchElement& element = OutMesh.Elements[0];
+	const FTerrainIndexBuffer& index_buffer = Adaptive ? AdaptiveIndexBuffers[LOD] : IndexBuffers->GetBuffer(LOD, EdgeMask);
+	element.IndexBuffer = &index_buffer;
+	element.FirstIndex = 0;
+	element.NumPrimitives = index_buffer.GetNumIndices() / 3;
+	element.MinVertexIndex = 0;
+	element.MaxVertexIndex = HeightVertexBuffer.GetNumVertices() - 1;
+	element.UserData = &LODUniformBuffers[LOD];
+}
+
 void FTerrainComponentSceneProxy::Initialize(int32 X, int32 Y, float Tiling)
 {
-	// Initialize buffers
+	// Initialize the buffers
 	uint32 width = GetTerrainComponentWidth(Size);
-	VertexBuffers.PositionVertexBuffer.Init(width * width);
-	VertexBuffers.StaticMeshVertexBuffer.Init(width * width, 1);
-
-	// Load data for all buffers
+	HeightVertexBuffer.Init(width * width);
+	NormalVertexBuffer.Init(width * width);
+	MorphVertexBuffer.Init(width * width);
+	IndexBuffers = FTerrainSharedIndexBuffers::Get(*MeshTemplate);
+	HeightVertexBuffer.InitResource();
+	NormalVertexBuffer.InitResource();
+	MorphVertexBuffer.InitResource();
+
+	// Load vertex data directly from the map proxy
 	UpdateMapData();
-	UpdateUVData(X, Y, Tiling);
+	TArray<float> errors;
+	MeshTemplate->GetLODErrors(&MapProxy->Data[MapProxy->X + 1], MapProxy->X, errors);
+	SetLODErrors(errors);
 
-	// Initialize the buffers
-	for (int32 i = 0; i < IndexBuffers.Num(); ++i)
+	// Adaptive index buffers are created here, later updates only replace their contents
+	if (Adaptive)
 	{
-		IndexBuffers[i].InitResource();
+		TArray<TArray<uint32>> indices;
+		BuildAdaptiveIndices(*MeshTemplate, &MapProxy->Data[MapProxy->X + 1], MapProxy->X, errors, AdaptiveErrorThreshold, indices);
+		AdaptiveIndexBuffers.SetNum(MaxLOD);
+		SetAdaptiveIndices(indices);
 	}
-	VertexBuffers.PositionVertexBuffer.InitResource();
-	VertexBuffers.StaticMeshVertexBuffer.InitResource();
+
+	// Mesh batches point into this array, so it is never resized after this
+	LODUniformBuffers.SetNum(MaxLOD);
+	UpdateLODUniformBuffers();
 
 	// Bind vertex factory data
-	FLocalVertexFactory::FDataType datatype;
-	VertexBuffers.PositionVertexBuffer.BindPositionVertexBuffer(&VertexFactory, datatype);
-	VertexBuffers.StaticMeshVertexBuffer.BindTangentVertexBuffer(&VertexFactory, datatype);
-	VertexBuffers.StaticMeshVertexBuffer.BindPackedTexCoordVertexBuffer(&VertexFactory, datatype);
-	VertexBuffers.StaticMeshVertexBuffer.BindLightMapVertexBuffer(&VertexFactory, datatype, 0);
-	FColorVertexBuffer::BindDefaultColorVertexBuffer(&VertexFactory, datatype, FColorVertexBuffer::NullBindStride::ZeroForDefaultBufferBind);
+	FTerrainVertexFactory::FDataType datatype;
+	datatype.HeightComponent = FVertexStreamComponent(&HeightVertexBuffer, 0, sizeof(float), VET_Float1);
+	datatype.NormalComponent = FVertexStreamComponent(&NormalVertexBuffer, 0, sizeof(FTerrainNormalVertex), VET_Short2N);
+	datatype.MorphHeightComponent = FVertexStreamComponent(&MorphVertexBuffer, 0, sizeof(float), VET_Float1);
 
 	// Initalize the vertex factory
 	VertexFactory.SetData(datatype);
+	VertexFactory.SetGridParameters(width, 1.0f);
+	VertexFactory.SetUVParameters(FVector2D(X * (width - 1), Y * (width - 1)), Tiling);
 	VertexFactory.InitResource();
+
+	UpdateVideoMemory();
+
+	// Start taking part in LOD selection for the terrain
+	RenderState->AddProxy(this, GridPosition);
+	UpdateOccluderHeights(&MapProxy->Data[MapProxy->X + 1], MapProxy->X);
 }
 
 /// Proxy Update Functions ///
 
-void FTerrainComponentSceneProxy::UpdateMap(TSharedPtr<FMapSection, ESPMode::ThreadSafe> SectionProxy)
+void FTerrainComponentSceneProxy::UpdateVertexData(TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData)
 {
-	// Copy map data to buffers
-	MapProxy = SectionProxy;
-	UpdateMapData();
-
-	// Copy buffers to RHI
+	// Ignore data built for a different component size
+	if (VertexData->Heights.Num() != HeightVertexBuffer.GetNumVertices() || VertexData->Normals.Num() != NormalVertexBuffer.GetNumVertices() || VertexData->MorphHeights.Num() != MorphVertexBuffer.GetNumVertices())
 	{
-		auto& vertex_buffer = VertexBuffers.PositionVertexBuffer;
-		void* vertex_data = RHILockVertexBuffer(vertex_buffer.VertexBufferRHI, 0, vertex_buffer.GetNumVertices() * vertex_buffer.GetStride(), RLM_WriteOnly);
-		FMemory::Memcpy(vertex_data, vertex_buffer.GetVertexData(), vertex_buffer.GetNumVertices() * vertex_buffer.GetStride());
-		RHIUnlockVertexBuffer(vertex_buffer.VertexBufferRHI);
+		return;
 	}
 
+	FMemory::Memcpy(HeightVertexBuffer.Lock(), VertexData->Heights.GetData(), HeightVertexBuffer.GetSize());
+	HeightVertexBuffer.Unlock();
+	FMemory::Memcpy(NormalVertexBuffer.Lock(), VertexData->Normals.GetData(), NormalVertexBuffer.GetSize());
+	NormalVertexBuffer.Unlock();
+	FMemory::Memcpy(MorphVertexBuffer.Lock(), VertexData->MorphHeights.GetData(), MorphVertexBuffer.GetSize());
+	MorphVertexBuffer.Unlock();
+	SetLODErrors(VertexData->LODErrors);
+	if (Adaptive)
 	{
-		auto& vertex_buffer = VertexBuffers.StaticMeshVertexBuffer;
-		void* vertex_data = RHILockVertexBuffer(vertex_buffer.TangentsVertexBuffer.VertexBufferRHI, 0, vertex_buffer.GetTangentSize(), RLM_WriteOnly);
-		FMemory::Memcpy(vertex_data, vertex_buffer.GetTangentData(), vertex_buffer.GetTangentSize());
-		RHIUnlockVertexBuffer(vertex_buffer.TangentsVertexBuffer.VertexBufferRHI);
+		SetAdaptiveIndices(VertexData->AdaptiveIndices);
 	}
+	UpdateLODUniformBuffers();
+	UpdateOccluderHeights(VertexData->Heights.GetData(), GetTerrainComponentWidth(Size));
+}
+
+void FTerrainComponentSceneProxy::UpdateLODErrorThreshold(float Pixels)
+{
+	LODErrorThreshold = Pixels;
+	UpdateLODUniformBuffers();
+}
+
+void FTerrainComponentSceneProxy::UpdateShadowLODBias(int32 Bias)
+{
+	ShadowLODBias = FMath::Max(Bias, 0);
 }
 
 void FTerrainComponentSceneProxy::UpdateUVs(int32 XOffset, int32 YOffset, float Tiling)
 {
-	// Set UV data
-	UpdateUVData(XOffset, YOffset, Tiling);
+	// UVs are generated in the vertex factory, so only the shader parameters need to change
+	uint32 width = GetTerrainComponentWidth(Size);
+	VertexFactory.SetUVParameters(FVector2D(XOffset * (width - 1), YOffset * (width - 1)), Tiling);
 
-	// Copy buffers to RHI
+	// A pooled component may have moved to a different place in the grid
+	FIntPoint position(XOffset, YOffset);
+	if (position != GridPosition)
 	{
-		auto& vertex_buffer = VertexBuffers.StaticMeshVertexBuffer;
-		void* vertex_data = RHILockVertexBuffer(vertex_buffer.TexCoordVertexBuffer.VertexBufferRHI, 0, vertex_buffer.GetTexCoordSize(), RLM_WriteOnly);
-		FMemory::Memcpy(vertex_data, vertex_buffer.GetTexCoordData(), vertex_buffer.GetTexCoordSize());
-		RHIUnlockVertexBuffer(vertex_buffer.TexCoordVertexBuffer.VertexBufferRHI);
+		RenderState->RemoveProxy(this, GridPosition);
+		GridPosition = position;
+		RenderState->AddProxy(this, GridPosition);
+		UpdateOccluderHeights(&MapProxy->Data[MapProxy->X + 1], MapProxy->X);
 	}
 }
 
 void FTerrainComponentSceneProxy::UpdateMapData()
 {
-	uint32 width = GetTerrainComponentWidth(Size);
-	for (uint32 y = 0; y < width; ++y)
+	// Vertex data is written straight into the RHI buffers so the proxy keeps no copy of the map
+	BuildVertices(*MapProxy, *MeshTemplate, HeightVertexBuffer.Lock(), NormalVertexBuffer.Lock(), MorphVertexBuffer.Lock());
+
+	HeightVertexBuffer.Unlock();
+	NormalVertexBuffer.Unlock();
+	MorphVertexBuffer.Unlock();
+}
+
+/// Vertex Generation ///
+
+// Build the normal of a single vertex from the heights of its four neighbours
+static FTerrainNormalVertex BuildVertexNormal(float s01, float s21, float s10, float s12, float Spacing)
+{
+	// The cross product of the tangents (2s, 0, s21 - s01) and (0, 2s, s12 - s10), scaled down by 2s
+	return FTerrainNormalVertex(FVector(s01 - s21, s10 - s12, 2.0f * Spacing));
+}
+
+// Build the heights and normals of one row of vertices, four vertices at a time, then the morph heights of the row
+static void BuildVertexRow(const FMapSection& Section, const FTerrainMeshTemplate& Template, float Spacing, uint32 Row, float* OutHeights, FTerrainNormalVertex* OutNormals, float* OutMorphHeights)
+{
+	uint32 Width = Template.Width;
+
+	// Rows of the section around the current row, offset past the one vertex border
+	const float* center = &Section.Data[(Row + 1) * Section.X + 1];
+	const float* above = center - Section.X;
+	const float* below = center + Section.X;
+
+	// Heights are a straight copy of the row
+	FMemory::Memcpy(OutHeights, center, Width * sizeof(float));
+
+	// With slopes dx and dy the normal is (-dx, -dy, 2s), which always points up, so the octahedral encoding is a
+	// division by the sum of the absolute components with no folding
+	const VectorRegister two = VectorSetFloat1(2.0f * Spacing);
+	const VectorRegister scale = VectorSetFloat1(-MAX_int16);
+	uint32 x = 0;
+	for (; x + 4 <= Width; x += 4)
 	{
-		for (uint32 x = 0; x < width; ++x)
+		VectorRegister dx = VectorSubtract(VectorLoad(center + x + 1), VectorLoad(center + x - 1));
+		VectorRegister dy = VectorSubtract(VectorLoad(below + x), VectorLoad(above + x));
+		VectorRegister inv_length = VectorMultiply(scale, VectorReciprocalAccurate(VectorAdd(VectorAdd(VectorAbs(dx), VectorAbs(dy)), two)));
+
+		float lanes[2][4];
+		VectorStore(VectorMultiply(dx, inv_length), lanes[0]);
+		VectorStore(VectorMultiply(dy, inv_length), lanes[1]);
+
+		for (uint32 i = 0; i < 4; ++i)
 		{
-			uint32 i = y * width + x;
-
-			// Position data
-			VertexBuffers.PositionVertexBuffer.VertexPosition(i) = FVector(x, y, MapProxy->Data[(y + 1) * MapProxy->X + x + 1]);
-
-			// Tangent data
-			int32 map_offset_x = x + 1;
-			int32 map_offset_y = y + 1;
-			float s01 = MapProxy->Data[map_offset_x - 1 + map_offset_y * MapProxy->X];
-			float s21 = MapProxy->Data[map_offset_x + 1 + map_offset_y * MapProxy->X];
-			float s10 = MapProxy->Data[map_offset_x + (map_offset_y - 1) * MapProxy->X];
-			float s12 = MapProxy->Data[map_offset_x + (map_offset_y + 1) * MapProxy->X];
-
-			// Get tangents in the x and y directions
-			FVector vx(2.0f, 0, s21 - s01);
-			FVector vy(0, 2.0f, s12 - s10);
-
-			// Calculate the cross product of the two tangents
-			vx.Normalize();
-			vy.Normalize();
-			VertexBuffers.StaticMeshVertexBuffer.SetVertexTangents(i, vx, vy, FVector::CrossProduct(vx, vy));
+			OutNormals[x + i].X = (int16)FMath::RoundToInt(lanes[0][i]);
+			OutNormals[x + i].Y = (int16)FMath::RoundToInt(lanes[1][i]);
 		}
 	}
+
+	// Finish the remaining vertices one at a time
+	for (; x < Width; ++x)
+	{
+		OutNormals[x] = BuildVertexNormal(center[x - 1], center[x + 1], above[x], below[x], Spacing);
+	}
+
+#if DO_GUARD_SLOW
+	// Verify the vector path against the scalar path, allowing for rounding differences
+	for (x = 0; x < Width; ++x)
+	{
+		FTerrainNormalVertex reference = BuildVertexNormal(center[x - 1], center[x + 1], above[x], below[x], Spacing);
+		checkSlow(FMath::Abs(OutNormals[x].X - reference.X) <= 1 && FMath::Abs(OutNormals[x].Y - reference.Y) <= 1);
+	}
+#endif
+
+	// Morph heights come from the coarse triangles around the row, which are read from the section directly
+	Template.GetMorphHeights(&Section.Data[Section.X + 1], Section.X, Row, OutMorphHeights);
 }
 
-void FTerrainComponentSceneProxy::UpdateUVData(int32 XOffset, int32 YOffset, float Tiling)
+void FTerrainComponentSceneProxy::BuildVertices(const FMapSection& Section, const FTerrainMeshTemplate& Template, float* OutHeights, FTerrainNormalVertex* OutNormals, float* OutMorphHeights, float Spacing)
 {
-	// Fill UV data
-	uint32 width = GetTerrainComponentWidth(Size);
-	XOffset *= width - 1;
-	YOffset *= width - 1;
-	for (uint32 y = 0; y < width; ++y)
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_BuildVertices);
+
+	// Rows are independent, so they are generated across worker threads
+	uint32 width = Template.Width;
+	ParallelFor(width, [&](int32 y) {
+		BuildVertexRow(Section, Template, Spacing, y, OutHeights + y * width, OutNormals + y * width, OutMorphHeights + y * width);
+		});
+}
+
+void FTerrainComponentSceneProxy::BuildAdaptiveIndices(const FTerrainMeshTemplate& Template, const float* Heights, uint32 Pitch, const TArray<float>& LODErrors, float ErrorThreshold, TArray<TArray<uint32>>& OutIndices)
+{
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_BuildAdaptive);
+
+	// The vertex errors are shared by every LOD, only the threshold changes
+	TArray<float> errors;
+	Template.GetAdaptiveErrors(Heights, Pitch, errors);
+
+	OutIndices.SetNum(LODErrors.Num());
+	for (int32 i = 0; i < LODErrors.Num(); ++i)
+	{
+		Template.GetAdaptiveIndices(errors, FMath::Max(LODErrors[i], ErrorThreshold), OutIndices[i]);
+		FTerrainMeshTemplate::OptimizeVertexCache(OutIndices[i], Template.Width * Template.Width);
+	}
+}
+
+void FTerrainComponentSceneProxy::ScaleLODs(float Scale)
+{
+	LODScales.Empty();
+	LODScales.SetNumUninitialized(MaxLOD);
+
+	for (uint32 i = 0; i < MaxLOD; ++i)
 	{
-		for (uint32 x = 0; x < width; ++x)
+		LODScales[i] = FMath::Pow(Scale, i);
+	}
+}
+
+void FTerrainComponentSceneProxy::UpdateLODUniformBuffers()
+{
+	// Distances in the shader are scaled the same way as the CPU scales pixels, so morphing ends where the next LOD is selected
+	FCachedSystemScalabilityCVars cvars = GetCachedScalabilityCVars();
+	float screen_scale = cvars.StaticMeshLODDistanceScale != 0.0f ? 1.0f / cvars.StaticMeshLODDistanceScale : 1.0f;
+	float error_scale = screen_scale / FMath::Max(LODErrorThreshold, KINDA_SMALL_NUMBER);
+	float diagonal = (GetTerrainComponentWidth(Size) - 1) * FMath::Sqrt(2.0f);
+
+	for (uint32 i = 0; i < (uint32)LODUniformBuffers.Num(); ++i)
+	{
+		// The last LOD has nothing to morph towards, so it uses a level no vertex has
+		// Morph heights follow the regular grids, so adaptive triangulations don't morph at all
+		bool has_next = !Adaptive && i + 1 < MaxLOD && i + 1 < (uint32)LODErrors.Num();
+		FTerrainLODParameters parameters;
+		parameters.MorphParameters.X = has_next ? i : 32.0f;
+		parameters.MorphParameters.Y = i < (uint32)LODErrors.Num() ? LODErrors[i] * error_scale : 0.0f;
+		parameters.MorphParameters.Z = has_next ? LODErrors[i + 1] * error_scale : 0.0f;
+		parameters.MorphParameters.W = diagonal;
+
+		// Update existing buffers in place so cached draw commands remain valid
+		if (LODUniformBuffers[i].IsValid())
+		{
+			LODUniformBuffers[i].UpdateUniformBufferImmediate(parameters);
+		}
+		else
 		{
-			VertexBuffers.StaticMeshVertexBuffer.SetVertexUV(y * width + x, 0, FVector2D((XOffset + x) * Tiling, (YOffset + y) * Tiling));
+			LODUniformBuffers[i] = TUniformBufferRef<FTerrainLODParameters>::CreateUniformBufferImmediate(parameters, UniformBuffer_MultiFrame);
 		}
 	}
 }
 
-void FTerrainComponentSceneProxy::UpdateIndexData(TArray<uint32>& Indices, uint32 Stride)
+void FTerrainComponentSceneProxy::SetAdaptiveIndices(const TArray<TArray<uint32>>& Indices)
 {
-	Stride = FMath::Exp2(Stride);
+	// Data built before the LOD settings changed is ignored, the proxy is about to be recreated
+	if (Indices.Num() < AdaptiveIndexBuffers.Num())
+	{
+		return;
+	}
+
 	uint32 width = GetTerrainComponentWidth(Size);
-	uint32 polygons = (width - 1) / Stride;
+	for (int32 i = 0; i < AdaptiveIndexBuffers.Num(); ++i)
+	{
+		AdaptiveIndexBuffers[i].ReleaseResource();
+		AdaptiveIndexBuffers[i].SetIndices(Indices[i], width * width);
+		AdaptiveIndexBuffers[i].InitResource();
+	}
+	UpdateVideoMemory();
+}
 
-	Indices.Empty();
-	Indices.SetNumUninitialized(polygons * polygons * 6);
-	for (uint32 y = 0; y < polygons; y++)
+void FTerrainComponentSceneProxy::UpdateVideoMemory()
+{
+	// Shared index buffers are counted once by the terrain
+	uint32 memory = HeightVertexBuffer.GetVideoMemorySize() + NormalVertexBuffer.GetVideoMemorySize() + MorphVertexBuffer.GetVideoMemorySize();
+	for (const FTerrainIndexBuffer& buffer : AdaptiveIndexBuffers)
 	{
-		for (uint32 x = 0; x < polygons; x++)
+		memory += buffer.GetVideoMemorySize();
+	}
+	VideoMemory->Set(memory);
+}
+
+void FTerrainComponentSceneProxy::SetLODErrors(const TArray<float>& Errors)
+{
+	LODErrors = Errors;
+	if (Adaptive)
+	{
+		for (float& error : LODErrors)
 		{
-			uint32 i = (y * polygons + x) * 6;
+			error = FMath::Max(error, AdaptiveErrorThreshold);
+		}
+	}
+}
 
-			Indices[i] = x * Stride + y * Stride * width;
-			Indices[i + 1] = (1 + x) * Stride + (y + 1) * Stride * width;
-			Indices[i + 2] = (1 + x) * Stride + y * Stride * width;
+void FTerrainComponentSceneProxy::UpdateOccluderHeights(const float* Heights, uint32 Pitch)
+{
+	// The component may be drawn at any of its LODs, so its heights are widened by the error of the coarsest one
+	float error = LODErrors.Num() > 0 ? LODErrors[FMath::Min<int32>(MaxLOD, LODErrors.Num()) - 1] : 0.0f;
+	RenderState->SetOccluderHeights(this, GridPosition, Heights, Pitch, GetTerrainComponentWidth(Size), error);
+}
 
-			Indices[i + 3] = x * Stride + y * Stride * width;
-			Indices[i + 4] = x * Stride + (y + 1) * Stride * width;
-			Indices[i + 5] = (1 + x) * Stride + (y + 1) * Stride * width;
-		}
+void FTerrainComponentSceneProxy::SelectLOD(const FSceneView& View, float ViewLODScale, uint32& OutLOD, uint32& OutEdgeMask) const
+{
+	if (!RenderState->GetLOD(View, ViewLODScale, GridPosition, OutLOD, OutEdgeMask))
+	{
+		OutLOD = GetViewLOD(View, ViewLODScale);
+		OutEdgeMask = 0;
 	}
+
+	// The terrain may have more LODs than this proxy if its settings changed recently
+	OutLOD = FMath::Min(OutLOD, MaxLOD - 1);
 }
 
-void FTerrainComponentSceneProxy::ScaleLODs(float Scale)
+void FTerrainComponentSceneProxy::ApplyShadowLODBias(uint32& LOD, uint32& EdgeMask) const
 {
-	LODScales.Empty();
-	LODScales.SetNumUninitialized(MaxLOD);
+	// Every component is biased by the same amount, so a neighbour that was one LOD coarser still is
+	// The exception is the last LOD, where neighbours are clamped to the same LOD and nothing needs stitching
+	LOD = FMath::Min(LOD + ShadowLODBias, MaxLOD - 1);
+	if (LOD == MaxLOD - 1)
+	{
+		EdgeMask = 0;
+	}
+}
 
-	for (uint32 i = 0; i < MaxLOD; ++i)
+uint32 FTerrainComponentSceneProxy::GetViewLOD(const FSceneView& View, float ViewLODScale, int32 PreviousLOD) const
+{
+	// Find the distance to the nearest point of the component
+	const FBoxSphereBounds& bounds = GetBounds();
+	float distance = 1.0f;
+	if (View.IsPerspectiveProjection())
 	{
-		LODScales[i] = FMath::Pow(Scale, i);
+		distance = FMath::Max(FMath::Sqrt(bounds.GetBox().ComputeSquaredDistanceToPoint(View.ViewMatrices.GetViewOrigin())), 1.0f);
 	}
-}
\ No newline at end of file
+
+	// Get the number of pixels a unit of local height covers at that distance
+	FCachedSystemScalabilityCVars cvars = GetCachedScalabilityCVars();
+	float screen_scale = cvars.StaticMeshLODDistanceScale != 0.0f ? 1.0f / cvars.StaticMeshLODDistanceScale : 1.0f;
+	const FMatrix& projection = View.ViewMatrices.GetProjectionMatrix();
+	float pixels = 0.5f * FMath::Max(projection.M[0][0] * View.UnconstrainedViewRect.Width(), projection.M[1][1] * View.UnconstrainedViewRect.Height()) / distance;
+	pixels *= FMath::Abs(GetLocalToWorld().GetScaleVector().Z) * screen_scale * ViewLODScale;
+
+	// Errors never decrease, so stop at the first LOD that is too coarse
+	// LODs coarser than the previous one have to pass the lower threshold as well
+	uint32 LOD = 0;
+	for (uint32 i = 1; i < MaxLOD && i < (uint32)LODErrors.Num(); ++i)
+	{
+		float threshold = PreviousLOD != INDEX_NONE && (int32)i > PreviousLOD ? LODErrorThreshold * TerrainLODHysteresis : LODErrorThreshold;
+		if (LODErrors[i] * pixels > threshold)
+		{
+			break;
+		}
+		LOD = i;
+	}
+
+	return LOD;
+}
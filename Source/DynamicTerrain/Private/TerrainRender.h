@@ -4,10 +4,51 @@
 #include "PrimitiveSceneProxy.h"
 
 #include "DynamicMeshBuilder.h"
+#include "TerrainVertexFactory.h"
 
 class UTerrainComponent;
+class FTerrainMeshTemplate;
+class FTerrainRenderState;
 struct FMapSection;
 
+// Vertex data for a single component, built from a map section on a worker thread before being uploaded to a proxy
+struct FTerrainVertexData
+{
+	TArray<float> Heights;
+	TArray<FTerrainNormalVertex> Normals;
+	TArray<float> MorphHeights;
+	// The geometric error of each LOD
+	TArray<float> LODErrors;
+	// The triangles of each LOD for components using adaptive triangulation
+	TArray<TArray<uint32>> AdaptiveIndices;
+};
+
+// GPU index buffers for every LOD and edge variant of a mesh template, shared by all proxies with the same component size
+// The cache and the buffers are only accessed on the rendering thread
+class FTerrainSharedIndexBuffers
+{
+public:
+	// Get the index buffers for a template, creating them if no proxy is currently using them
+	static TSharedRef<FTerrainSharedIndexBuffers> Get(const FTerrainMeshTemplate& Template);
+	~FTerrainSharedIndexBuffers();
+
+	// Get the index buffer for an LOD with the given edges stitched
+	FTerrainIndexBuffer& GetBuffer(uint32 LOD, uint32 EdgeMask);
+	// Get the GPU memory used by the buffers of a component size, zero if no proxy is using them
+	// Unlike the rest of the class, this can be called from any thread
+	static uint32 GetVideoMemorySize(uint32 ComponentSize);
+
+	// Index buffers for each LOD and edge variant, indexed by LOD * NumEdgeVariants + EdgeMask
+	TArray<FTerrainIndexBuffer> Buffers;
+	// The component size of the template the buffers were built from
+	uint32 Size = 0;
+
+private:
+	// Guards the memory used by each component size
+	static FCriticalSection MemoryLock;
+	static TMap<uint32, uint32> VideoMemory;
+};
+
 // A rendering proxy which stores rendering data for a single terrain component
 // Functions for the proxy should only be called on the rendering thread (with the exception of the constructor)
 // Use functions in UTerrainComponent to change proxies on the game thread
@@ -30,49 +71,103 @@ public:
 		return (sizeof(*this) + GetAllocatedSize());
 	}
 
-	uint32 GetAllocatedSize() const
-	{
-		return(FPrimitiveSceneProxy::GetAllocatedSize());
-	}
+	// Get the CPU memory owned by the proxy, shared index buffers and the map section are counted elsewhere
+	uint32 GetAllocatedSize() const;
 
 	virtual bool CanBeOccluded() const override
 	{
 		return !MaterialRelevance.bDisableDepthTest;
 	}
 
+	virtual bool IsUsingCustomLODRules() const override
+	{
+		return true;
+	}
+
+	virtual FLODMask GetCustomLOD(const FSceneView& InView, float InViewLODScale, int32 InForcedLODLevel, float& OutScreenSizeSquared) const override;
+
+	virtual bool IsUsingCustomWholeSceneShadowLODRules() const override
+	{
+		return true;
+	}
+
+	virtual FLODMask GetCustomWholeSceneShadowLOD(const FSceneView& InView, float InViewLODScale, int32 InForcedLODLevel, const FLODMask& InVisibilePrimitiveLODMask, float InShadowMapTextureResolution, float InShadowMapCascadeSize, int8 InShadowCascadeId, bool InHasSelfShadow) const override;
+	virtual void DrawStaticElements(FStaticPrimitiveDrawInterface* PDI) override;
 	virtual void GetDynamicMeshElements(const TArray< const FSceneView* >& Views, const FSceneViewFamily& ViewFamily, uint32 VisibilityMap, class FMeshElementCollector& Collector) const override;
 	virtual FPrimitiveViewRelevance GetViewRelevance(const FSceneView* View) const override;
 
+	/// LOD Selection ///
+
+	// Select the LOD for a view on its own, the LOD is the least detailed one whose projected error stays under the threshold
+	// With a previous LOD a coarser LOD is only chosen once its error is well under the threshold, so LODs don't flicker at the threshold
+	uint32 GetViewLOD(const FSceneView& View, float ViewLODScale, int32 PreviousLOD = INDEX_NONE) const;
+
+	/// Vertex Generation ///
+
+	// Generate heights, normals and morph heights for a component from a map section, this can be called on any thread
+	// The output arrays must have room for a vertex for every vertex of the template
+	// Spacing is the local distance between the vertices of the section, which is larger than 1 for sections sampled from a coarser grid
+	static void BuildVertices(const FMapSection& Section, const FTerrainMeshTemplate& Template, float* OutHeights, FTerrainNormalVertex* OutNormals, float* OutMorphHeights, float Spacing = 1.0f);
+	// Build an adaptive triangulation for every LOD of a component, this can be called on any thread
+	// Each LOD is allowed the error of the regular grid it replaces, but never less than ErrorThreshold
+	static void BuildAdaptiveIndices(const FTerrainMeshTemplate& Template, const float* Heights, uint32 Pitch, const TArray<float>& LODErrors, float ErrorThreshold, TArray<TArray<uint32>>& OutIndices);
+
 	/// Proxy Update Functions ///
 
-	// Update rending data using the provided proxy
-	void UpdateMap(TSharedPtr<FMapSection, ESPMode::ThreadSafe> SectionProxy);
-	// Update UV tiling
+	// Upload vertex data that was built from a newer map section
+	void UpdateVertexData(TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData);
+	// Change the largest error in pixels an LOD can show on screen
+	void UpdateLODErrorThreshold(float Pixels);
+	// Change the number of LODs coarser than the main view that whole scene shadows use
+	void UpdateShadowLODBias(int32 Bias);
+	// Update UV tiling, this only changes shader parameters
 	void UpdateUVs(int32 XOffset, int32 YOffset, float Tiling);
 
 protected:
+	// Set up a mesh batch for an LOD and edge variant, the primitive uniform buffer is left to the caller
+	void GetMeshBatch(uint32 LOD, uint32 EdgeMask, const FMaterialRenderProxy* MaterialProxy, FMeshBatch& OutMesh) const;
+	// Select the LOD for a view together with the rest of the terrain, and get the edges that need to be stitched
+	void SelectLOD(const FSceneView& View, float ViewLODScale, uint32& OutLOD, uint32& OutEdgeMask) const;
+	// Make an LOD selected for the main view coarser for shadows, keeping its edges stitched to the biased neighbours
+	void ApplyShadowLODBias(uint32& LOD, uint32& EdgeMask) const;
 	// Initialize vertex buffers
 	void Initialize(int32 X, int32 Y, float Tiling);
 	// Update rendering data using the current map proxy data
 	void UpdateMapData();
-	// Update mesh UVs using the provided offsets and tiling
-	void UpdateUVData(int32 XOffset, int32 YOffset, float Tiling);
-	// Fill index buffers
-	void UpdateIndexData(TArray<uint32>& Indices, uint32 Stride);
 	// Set LOD scales for each lod
 	void ScaleLODs(float Scale);
+	// Update the morph parameters of each LOD from the current errors
+	void UpdateLODUniformBuffers();
+	// Replace the adaptive triangulation of each LOD
+	void SetAdaptiveIndices(const TArray<TArray<uint32>>& Indices);
+	// Record the allocated size of the buffers that belong to this proxy alone, so the component can report it
+	void UpdateVideoMemory();
+	// Set the errors of each LOD, adaptive LODs are never more accurate than their threshold
+	void SetLODErrors(const TArray<float>& Errors);
+	// Send the full resolution heights of the component to the horizon culler, Pitch is the distance between rows
+	void UpdateOccluderHeights(const float* Heights, uint32 Pitch);
 
 	// The heightmap data the component needs to render
 	TSharedPtr<FMapSection, ESPMode::ThreadSafe> MapProxy = nullptr;
 	// The width of the component, the number of vertices is Size * Size + 1
 	uint32 Size;
 
-	// The vertex buffers containing mesh data
-	FStaticMeshVertexBuffers VertexBuffers;
-	// The triangles used by the component's mesh
-	TArray<FDynamicMeshIndexBuffer32> IndexBuffers;
+	// The vertex buffers containing mesh data, XY positions and UVs are generated by the vertex factory
+	TTerrainVertexBuffer<float> HeightVertexBuffer;
+	TTerrainVertexBuffer<FTerrainNormalVertex> NormalVertexBuffer;
+	TTerrainVertexBuffer<float> MorphVertexBuffer;
+	// The mesh topology shared by components of the same size
+	TSharedPtr<const FTerrainMeshTemplate, ESPMode::ThreadSafe> MeshTemplate;
+	// The triangles used by the component's mesh, shared with other proxies of the same size
+	TSharedPtr<FTerrainSharedIndexBuffers> IndexBuffers;
+	// The triangles of each LOD when the component uses adaptive triangulation, these belong to this proxy alone
+	TArray<FTerrainIndexBuffer> AdaptiveIndexBuffers;
+	// Set to true to draw the adaptive triangulation, which changes with every edit so it is always drawn dynamically
+	bool Adaptive;
+	// The largest vertical error of the full detail adaptive triangulation
+	float AdaptiveErrorThreshold;
 	// The vertex factory for storing vertex type data
-	FLocalVertexFactory VertexFactory;
+	FTerrainVertexFactory VertexFactory;
 
 	// The material used to render the component
 	UMaterialInterface* Material;
@@ -80,6 +175,23 @@ protected:
 
 	// The number of LODs to create for the mesh
 	uint32 MaxLOD;
-	// LOD scales for each individual LOD
+	// LOD scales for each individual LOD, these are the screen sizes the static batches are registered with
 	TArray<float> LODScales;
+	// The largest vertical distance between each LOD and the full resolution surface, in local space
+	TArray<float> LODErrors;
+	// The largest error in pixels an LOD can show on screen
+	float LODErrorThreshold;
+	// The number of LODs coarser than the main view that whole scene shadows use
+	uint32 ShadowLODBias;
+	// Morph parameters for each LOD, mesh batches point to these in their UserData
+	TArray<TUniformBufferRef<FTerrainLODParameters>> LODUniformBuffers;
+
+	// LOD selection shared with the other components of the terrain
+	TSharedPtr<FTerrainRenderState, ESPMode::ThreadSafe> RenderState;
+	// The position of the component in the terrain's component grid
+	FIntPoint GridPosition;
+	// The edges of the component that can border another component, static batches are only registered for these
+	uint32 StitchedEdges;
+	// The GPU memory used by the buffers that belong to this proxy alone, shared with the component
+	TSharedPtr<FThreadSafeCounter, ESPMode::ThreadSafe> VideoMemory;
 };
\ No newline at end of file
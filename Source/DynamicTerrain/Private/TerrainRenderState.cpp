@@ -0,0 +1,323 @@
+#include "TerrainRenderState.h"
+#include "TerrainRender.h"
+#include "TerrainMeshTemplate.h"
+#include "TerrainStat.h"
+
+#include "SceneView.h"
+#include "Misc/ScopeLock.h"
+
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Select LODs"), STAT_DynamicTerrain_SelectLODs, STATGROUP_DynamicTerrain);
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Limit Neighbour LODs"), STAT_DynamicTerrain_LimitLODs, STATGROUP_DynamicTerrain);
+DECLARE_CYCLE_STAT(TEXT("Dynamic Terrain - Horizon Culling"), STAT_DynamicTerrain_HorizonCulling, STATGROUP_DynamicTerrain);
+
+// Views that haven't requested LODs for this many frames are forgotten
+static const uint32 TerrainViewTimeout = 60;
+
+/// Proxy Registration ///
+
+void FTerrainRenderState::AddProxy(FTerrainComponentSceneProxy* Proxy, FIntPoint Position)
+{
+	check(IsInRenderingThread());
+
+	FScopeLock lock(&Lock);
+	Proxies.Add(Position, Proxy);
+	ForgetComponent(Position);
+}
+
+void FTerrainRenderState::RemoveProxy(FTerrainComponentSceneProxy* Proxy, FIntPoint Position)
+{
+	check(IsInRenderingThread());
+
+	FScopeLock lock(&Lock);
+	FTerrainComponentSceneProxy** existing = Proxies.Find(Position);
+	if (existing != nullptr && *existing == Proxy)
+	{
+		Proxies.Remove(Position);
+		Culler.RemoveComponent(Position);
+		ForgetComponent(Position);
+	}
+}
+
+void FTerrainRenderState::SetOccluderHeights(FTerrainComponentSceneProxy* Proxy, FIntPoint Position, const float* Heights, uint32 Pitch, uint32 Width, float Error)
+{
+	check(IsInRenderingThread());
+
+	FScopeLock lock(&Lock);
+	FTerrainComponentSceneProxy** existing = Proxies.Find(Position);
+	if (existing != nullptr && *existing == Proxy)
+	{
+		Culler.SetComponent(Position, Heights, Pitch, Width, Error);
+	}
+}
+
+void FTerrainRenderState::SetHorizonCulling(bool Enable)
+{
+	check(IsInRenderingThread());
+
+	FScopeLock lock(&Lock);
+	HorizonCulling = Enable;
+	ResetSnapshots();
+}
+
+/// LOD Selection ///
+
+bool FTerrainRenderState::GetLOD(const FSceneView& View, float ViewLODScale, FIntPoint Position, uint32& OutLOD, uint32& OutEdgeMask)
+{
+	const FViewLODs& view_lods = FindView(View, ViewLODScale);
+	uint8 lod = view_lods.GetLOD(Position);
+	if (lod == MAX_uint8)
+	{
+		return false;
+	}
+
+	OutLOD = lod;
+	OutEdgeMask = view_lods.EdgeMasks[(Position.Y - view_lods.Grid.Min.Y) * view_lods.Grid.Width() + Position.X - view_lods.Grid.Min.X];
+	return true;
+}
+
+bool FTerrainRenderState::IsOccluded(const FSceneView& View, float ViewLODScale, FIntPoint Position)
+{
+	// Occlusion is found along with the LODs, so a view with horizon culling disabled has none
+	const FViewLODs& view_lods = FindView(View, ViewLODScale);
+	if (!view_lods.Grid.Contains(Position) || view_lods.Occluded.Num() != view_lods.Grid.Area())
+	{
+		return false;
+	}
+	return view_lods.Occluded[(Position.Y - view_lods.Grid.Min.Y) * view_lods.Grid.Width() + Position.X - view_lods.Grid.Min.X];
+}
+
+const FTerrainRenderState::FViewLODs& FTerrainRenderState::FindView(const FSceneView& View, float ViewLODScale)
+{
+	uint32 key = View.GetViewKey();
+	if (key == 0)
+	{
+		key = PointerHash(&View);
+	}
+
+	// Views that already selected LODs this frame are read from the snapshot without the lock
+	const FFrameLODs* snapshot = Snapshot.Load();
+	if (snapshot != nullptr && snapshot->FrameNumber == View.Family->FrameNumber)
+	{
+		const TSharedPtr<const FViewLODs, ESPMode::ThreadSafe>* lods = snapshot->Views.Find(key);
+		if (lods != nullptr && (*lods)->ViewLODScale == ViewLODScale)
+		{
+			return **lods;
+		}
+	}
+
+	FScopeLock lock(&Lock);
+	return UpdateView(View, ViewLODScale, key);
+}
+
+const FTerrainRenderState::FViewLODs& FTerrainRenderState::UpdateView(const FSceneView& View, float ViewLODScale, uint32 Key)
+{
+	uint32 frame = View.Family->FrameNumber;
+
+	// Another task may have selected LODs for the view while this one waited for the lock
+	TSharedPtr<const FViewLODs, ESPMode::ThreadSafe>* previous = Views.Find(Key);
+	if (previous != nullptr && (*previous)->FrameNumber == frame && (*previous)->ViewLODScale == ViewLODScale && (*previous)->Revision == Revision)
+	{
+		return **previous;
+	}
+
+	// Select LODs for the whole terrain the first time a component asks for them this frame
+	// A change of LOD scale isn't a camera movement, so the previous LODs give no useful hysteresis
+	TSharedRef<FViewLODs, ESPMode::ThreadSafe> lods = previous != nullptr ? MakeShared<FViewLODs, ESPMode::ThreadSafe>(**previous) : MakeShared<FViewLODs, ESPMode::ThreadSafe>();
+	if (lods->ViewLODScale != ViewLODScale)
+	{
+		lods->DesiredLODs.Empty();
+	}
+	BuildViewLODs(View, ViewLODScale, *lods);
+	lods->FrameNumber = frame;
+	lods->ViewLODScale = ViewLODScale;
+
+	// Orthographic views have no eye to find a horizon around
+	lods->Occluded.Empty();
+	if (HorizonCulling && lods->LODs.Num() > 0 && View.IsPerspectiveProjection() && Culler.GetComponentPolygons() > 0)
+	{
+		SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_HorizonCulling);
+
+		// Move the eye into terrain space through any of the components, each of which sits at its place in the grid
+		auto proxy = Proxies.CreateConstIterator();
+		FVector eye = proxy.Value()->GetLocalToWorld().InverseTransformPosition(View.ViewMatrices.GetViewOrigin());
+		eye += FVector(FVector2D(proxy.Key()) * Culler.GetComponentPolygons(), 0.0f);
+		Culler.GetOccluded(eye, lods->Grid, lods->Occluded);
+	}
+	Views.Add(Key, lods);
+
+	// Forget views that are no longer rendered
+	for (auto it = Views.CreateIterator(); it; ++it)
+	{
+		if (it.Value()->FrameNumber + TerrainViewTimeout < frame)
+		{
+			it.RemoveCurrent();
+		}
+	}
+
+	// Publish a new snapshot with every view that selected LODs this frame
+	// Snapshots of earlier frames can be freed, the visibility tasks that read them have finished
+	FFrameLODs* snapshot = new FFrameLODs();
+	snapshot->FrameNumber = frame;
+	for (const TPair<uint32, TSharedPtr<const FViewLODs, ESPMode::ThreadSafe>>& view : Views)
+	{
+		if (view.Value->FrameNumber == frame)
+		{
+			snapshot->Views.Add(view.Key, view.Value);
+		}
+	}
+	Snapshots.RemoveAll([frame](const TUniquePtr<const FFrameLODs>& Old) {
+		return Old->FrameNumber != frame;
+		});
+	Snapshots.Emplace(snapshot);
+	Snapshot = snapshot;
+
+	return *lods;
+}
+
+void FTerrainRenderState::ResetSnapshots()
+{
+	check(IsInRenderingThread());
+
+	// Views select their LODs again the next time they are used, without losing their previous LODs
+	Snapshot = nullptr;
+	Snapshots.Empty();
+	++Revision;
+}
+
+void FTerrainRenderState::ForgetComponent(FIntPoint Position)
+{
+	ResetSnapshots();
+
+	// Only the component at the position loses its previous LODs, the rest of the terrain keeps its hysteresis
+	for (TPair<uint32, TSharedPtr<const FViewLODs, ESPMode::ThreadSafe>>& view : Views)
+	{
+		const FViewLODs& old = *view.Value;
+		if (old.Grid.Contains(Position) && old.DesiredLODs.Num() == old.Grid.Area())
+		{
+			TSharedRef<FViewLODs, ESPMode::ThreadSafe> lods = MakeShared<FViewLODs, ESPMode::ThreadSafe>(old);
+			lods->DesiredLODs[(Position.Y - old.Grid.Min.Y) * old.Grid.Width() + Position.X - old.Grid.Min.X] = MAX_uint8;
+			view.Value = lods;
+		}
+	}
+}
+
+void FTerrainRenderState::BuildViewLODs(const FSceneView& View, float ViewLODScale, FViewLODs& LODs) const
+{
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_SelectLODs);
+
+	if (Proxies.Num() == 0)
+	{
+		LODs.DesiredLODs.Empty();
+		LODs.LODs.Empty();
+		return;
+	}
+
+	// Find the area of the grid covered by components
+	FIntRect grid(MAX_int32, MAX_int32, MIN_int32, MIN_int32);
+	for (const TPair<FIntPoint, FTerrainComponentSceneProxy*>& proxy : Proxies)
+	{
+		grid.Include(proxy.Key);
+	}
+	grid.Max += FIntPoint(1, 1);
+	int32 width = grid.Width();
+	int32 height = grid.Height();
+
+	// Get the LOD each component would like to use on its own, moving away from its previous LOD only past the hysteresis band
+	// The grid grows and shrinks as components are streamed in and out, so previous LODs are found by position
+	bool has_previous = LODs.DesiredLODs.Num() == LODs.Grid.Area();
+	TArray<uint8> desired;
+	desired.Init(MAX_uint8, width * height);
+	for (const TPair<FIntPoint, FTerrainComponentSceneProxy*>& proxy : Proxies)
+	{
+		int32 i = (proxy.Key.Y - grid.Min.Y) * width + proxy.Key.X - grid.Min.X;
+		int32 previous = INDEX_NONE;
+		if (has_previous && LODs.Grid.Contains(proxy.Key))
+		{
+			uint8 lod = LODs.DesiredLODs[(proxy.Key.Y - LODs.Grid.Min.Y) * LODs.Grid.Width() + proxy.Key.X - LODs.Grid.Min.X];
+			previous = lod != MAX_uint8 ? lod : INDEX_NONE;
+		}
+		desired[i] = (uint8)proxy.Value->GetViewLOD(View, ViewLODScale, previous);
+	}
+
+	// Nothing else needs to change unless a component selected a different LOD or components were added or removed
+	if (LODs.Revision == Revision && LODs.Grid == grid && LODs.LODs.Num() == width * height && desired == LODs.DesiredLODs)
+	{
+		return;
+	}
+
+	SCOPE_CYCLE_COUNTER(STAT_DynamicTerrain_LimitLODs);
+
+	LODs.Grid = grid;
+	LODs.Revision = Revision;
+	LODs.DesiredLODs = desired;
+	TArray<int32> lods;
+	lods.SetNumUninitialized(width * height);
+	for (int32 i = 0; i < lods.Num(); ++i)
+	{
+		lods[i] = desired[i];
+	}
+
+	// Limit each LOD to one more than any of its neighbours with a chebyshev distance transform
+	// This only ever makes components more detailed than they wanted to be
+	for (int32 y = 0; y < height; ++y)
+	{
+		for (int32 x = 0; x < width; ++x)
+		{
+			int32& lod = lods[y * width + x];
+			if (x > 0)
+			{
+				lod = FMath::Min(lod, lods[y * width + x - 1] + 1);
+			}
+			if (y > 0)
+			{
+				for (int32 i = FMath::Max(x - 1, 0); i <= FMath::Min(x + 1, width - 1); ++i)
+				{
+					lod = FMath::Min(lod, lods[(y - 1) * width + i] + 1);
+				}
+			}
+		}
+	}
+	for (int32 y = height - 1; y >= 0; --y)
+	{
+		for (int32 x = width - 1; x >= 0; --x)
+		{
+			int32& lod = lods[y * width + x];
+			if (x < width - 1)
+			{
+				lod = FMath::Min(lod, lods[y * width + x + 1] + 1);
+			}
+			if (y < height - 1)
+			{
+				for (int32 i = FMath::Max(x - 1, 0); i <= FMath::Min(x + 1, width - 1); ++i)
+				{
+					lod = FMath::Min(lod, lods[(y + 1) * width + i] + 1);
+				}
+			}
+		}
+	}
+
+	// Store the results, leaving gaps in the grid empty
+	LODs.LODs.Init(MAX_uint8, width * height);
+	for (const TPair<FIntPoint, FTerrainComponentSceneProxy*>& proxy : Proxies)
+	{
+		int32 i = (proxy.Key.Y - grid.Min.Y) * width + proxy.Key.X - grid.Min.X;
+		LODs.LODs[i] = (uint8)lods[i];
+	}
+
+	// Neighbours are never more than one LOD coarser, so each edge is either stitched or not
+	static const FIntPoint offsets[4] = { FIntPoint(-1, 0), FIntPoint(1, 0), FIntPoint(0, -1), FIntPoint(0, 1) };
+	static const uint8 edges[4] = { ETerrainEdge::NegativeX, ETerrainEdge::PositiveX, ETerrainEdge::NegativeY, ETerrainEdge::PositiveY };
+	LODs.EdgeMasks.Init(0, width * height);
+	for (const TPair<FIntPoint, FTerrainComponentSceneProxy*>& proxy : Proxies)
+	{
+		int32 i = (proxy.Key.Y - grid.Min.Y) * width + proxy.Key.X - grid.Min.X;
+		for (int32 j = 0; j < 4; ++j)
+		{
+			uint8 neighbour = LODs.GetLOD(proxy.Key + offsets[j]);
+			if (neighbour != MAX_uint8 && neighbour > LODs.LODs[i])
+			{
+				LODs.EdgeMasks[i] |= edges[j];
+			}
+		}
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Templates/Atomic.h"
+
+#include "TerrainHorizonCuller.h"
+
+class FSceneView;
+class FTerrainComponentSceneProxy;
+
+// Render state shared by every component of a terrain
+// LODs are selected for the whole terrain at once, so neighbouring components never differ by more than one LOD and
+// each component knows which of its edges have to be stitched to a coarser neighbour
+// Proxies are added and removed on the rendering thread, LODs may be requested from parallel visibility tasks
+// The first request of a view in a frame selects LODs under the lock and publishes them in an immutable snapshot of the
+// frame, every other request reads the snapshot without taking the lock
+// Each view remembers its LODs between frames, so components resist switching LODs near the threshold and the
+// neighbour limits and edge masks are only rebuilt on frames where some component's LOD changes
+// With horizon culling enabled, each view also finds the components hidden behind the rest of the terrain once per frame
+class FTerrainRenderState
+{
+public:
+	// Register a proxy at a position in the component grid
+	void AddProxy(FTerrainComponentSceneProxy* Proxy, FIntPoint Position);
+	// Remove a proxy, nothing happens if another proxy has replaced it
+	void RemoveProxy(FTerrainComponentSceneProxy* Proxy, FIntPoint Position);
+
+	// Get the LOD of a component in a view and the edges that border a coarser component
+	// Returns false if no proxy is registered at the position
+	bool GetLOD(const FSceneView& View, float ViewLODScale, FIntPoint Position, uint32& OutLOD, uint32& OutEdgeMask);
+
+	// Set the heights a component occludes with from its full resolution grid, nothing happens if another proxy has replaced it
+	void SetOccluderHeights(FTerrainComponentSceneProxy* Proxy, FIntPoint Position, const float* Heights, uint32 Pitch, uint32 Width, float Error);
+	// Enable or disable culling components that are hidden behind the terrain
+	void SetHorizonCulling(bool Enable);
+	// Check if a component is hidden behind the rest of the terrain in a view, always false with horizon culling disabled
+	bool IsOccluded(const FSceneView& View, float ViewLODScale, FIntPoint Position);
+
+protected:
+	// The LODs of every component for a single view
+	struct FViewLODs
+	{
+		uint32 FrameNumber = 0;
+		float ViewLODScale = 0.0f;
+		// The revision of the render state the neighbour limits were built for
+		uint32 Revision = 0;
+		// The area of the component grid covered by the LOD array
+		FIntRect Grid;
+		// The LOD each component selected on its own, before neighbours were taken into account
+		TArray<uint8> DesiredLODs;
+		// The LOD of each component in the grid, MAX_uint8 where there is no component
+		TArray<uint8> LODs;
+		// The edges of each component that border a coarser component
+		TArray<uint8> EdgeMasks;
+		// The components in the grid hidden behind the terrain, empty without horizon culling
+		TBitArray<> Occluded;
+
+		inline uint8 GetLOD(FIntPoint Position) const
+		{
+			if (Position.X < Grid.Min.X || Position.Y < Grid.Min.Y || Position.X >= Grid.Max.X || Position.Y >= Grid.Max.Y)
+			{
+				return MAX_uint8;
+			}
+			return LODs[(Position.Y - Grid.Min.Y) * Grid.Width() + Position.X - Grid.Min.X];
+		}
+	};
+
+	// The LODs of every view that has selected them in a frame, never modified once published
+	struct FFrameLODs
+	{
+		uint32 FrameNumber = 0;
+		TMap<uint32, TSharedPtr<const FViewLODs, ESPMode::ThreadSafe>> Views;
+	};
+
+	// Get the LODs of a view, selecting them the first time the view is used in a frame
+	// The result stays valid until the LODs of a later frame are published or a proxy is added or removed
+	const FViewLODs& FindView(const FSceneView& View, float ViewLODScale);
+	// Select LODs for a view and publish them with the frame's snapshot, the lock must be held
+	const FViewLODs& UpdateView(const FSceneView& View, float ViewLODScale, uint32 Key);
+	// Select LODs for every component in a view, starting from the LODs the view selected last time
+	void BuildViewLODs(const FSceneView& View, float ViewLODScale, FViewLODs& LODs) const;
+	// Discard the published snapshots, so every view selects its LODs again the next time it is used
+	// Only called on the rendering thread outside of visibility tasks, the lock must be held
+	void ResetSnapshots();
+	// Discard the previous LODs of a component that was added or removed, the lock must be held
+	void ForgetComponent(FIntPoint Position);
+
+	// The snapshot of the current frame, read without the lock
+	TAtomic<const FFrameLODs*> Snapshot { nullptr };
+
+	// Guards everything below
+	FCriticalSection Lock;
+	// The proxy at each position in the component grid
+	TMap<FIntPoint, FTerrainComponentSceneProxy*> Proxies;
+	// The LODs each view selected last, kept between frames for hysteresis
+	TMap<uint32, TSharedPtr<const FViewLODs, ESPMode::ThreadSafe>> Views;
+	// Every snapshot published in the current frame, visibility tasks may still be reading any of them
+	TArray<TUniquePtr<const FFrameLODs>> Snapshots;
+	// The heights of every component, used to find the components hidden behind the terrain
+	FTerrainHorizonCuller Culler;
+	// Set to true to cull components hidden behind the terrain
+	bool HorizonCulling = false;
+	// Incremented whenever components are added or removed or settings change, LODs built for an older revision are rebuilt
+	uint32 Revision = 0;
+};
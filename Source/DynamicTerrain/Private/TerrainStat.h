@@ -1,3 +1,12 @@
 #pragma once
 
-DECLARE_STATS_GROUP(TEXT("Dynamic Terrain Plugin"), STATGROUP_DynamicTerrain, STATCAT_Advanced)
\ No newline at end of file
+DECLARE_STATS_GROUP(TEXT("Dynamic Terrain Plugin"), STATGROUP_DynamicTerrain, STATCAT_Advanced)
+
+// Diagnostics for building terrain meshes
+DECLARE_LOG_CATEGORY_EXTERN(LogDynamicTerrain, Log, All);
+
+// GPU memory used by the vertex and index buffers of every terrain
+DECLARE_MEMORY_STAT_POOL_EXTERN(TEXT("Dynamic Terrain - Vertex Buffer Memory"), STAT_DynamicTerrain_VertexBufferMemory, STATGROUP_DynamicTerrain, FPlatformMemory::MCR_GPU, );
+DECLARE_MEMORY_STAT_POOL_EXTERN(TEXT("Dynamic Terrain - Index Buffer Memory"), STAT_DynamicTerrain_IndexBufferMemory, STATGROUP_DynamicTerrain, FPlatformMemory::MCR_GPU, );
+// CPU memory used by the copies of index data that index buffers keep for reinitialization
+DECLARE_MEMORY_STAT_EXTERN(TEXT("Dynamic Terrain - Index Data Memory"), STAT_DynamicTerrain_IndexDataMemory, STATGROUP_DynamicTerrain, );
@@ -0,0 +1,222 @@
+#include "TerrainVertexFactory.h"
+
+#include "MeshMaterialShader.h"
+#include "MeshDrawShaderBindings.h"
+#include "Materials/Material.h"
+
+IMPLEMENT_GLOBAL_SHADER_PARAMETER_STRUCT(FTerrainVertexFactoryParameters, "TerrainVF");
+IMPLEMENT_GLOBAL_SHADER_PARAMETER_STRUCT(FTerrainLODParameters, "TerrainLOD");
+
+DEFINE_STAT(STAT_DynamicTerrain_VertexBufferMemory);
+DEFINE_STAT(STAT_DynamicTerrain_IndexBufferMemory);
+DEFINE_STAT(STAT_DynamicTerrain_IndexDataMemory);
+
+/// Normal Encoding ///
+
+FTerrainNormalVertex::FTerrainNormalVertex(const FVector& Normal)
+{
+	// Project the normal onto the octahedron, then fold the lower hemisphere over the upper one
+	float x = 0.0f;
+	float y = 0.0f;
+	float length = FMath::Abs(Normal.X) + FMath::Abs(Normal.Y) + FMath::Abs(Normal.Z);
+	if (length > 0.0f)
+	{
+		x = Normal.X / length;
+		y = Normal.Y / length;
+		if (Normal.Z < 0.0f)
+		{
+			float fold_x = (1.0f - FMath::Abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+			float fold_y = (1.0f - FMath::Abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			x = fold_x;
+			y = fold_y;
+		}
+	}
+
+	X = (int16)FMath::Clamp(FMath::RoundToInt(x * MAX_int16), -MAX_int16, (int32)MAX_int16);
+	Y = (int16)FMath::Clamp(FMath::RoundToInt(y * MAX_int16), -MAX_int16, (int32)MAX_int16);
+
+#if DO_GUARD_SLOW
+	// Verify that the encoding round trips within the precision of 16 bit components
+	if (length > 0.0f)
+	{
+		checkSlow((ToFVector() - Normal.GetSafeNormal()).GetAbsMax() < 1.0e-3f);
+	}
+#endif
+}
+
+FVector FTerrainNormalVertex::ToFVector() const
+{
+	FVector normal((float)X / MAX_int16, (float)Y / MAX_int16, 0.0f);
+	normal.Z = 1.0f - FMath::Abs(normal.X) - FMath::Abs(normal.Y);
+	if (normal.Z < 0.0f)
+	{
+		float x = (1.0f - FMath::Abs(normal.Y)) * (normal.X >= 0.0f ? 1.0f : -1.0f);
+		float y = (1.0f - FMath::Abs(normal.X)) * (normal.Y >= 0.0f ? 1.0f : -1.0f);
+		normal.X = x;
+		normal.Y = y;
+	}
+
+	return normal.GetSafeNormal();
+}
+
+/// Index Buffer ///
+
+FTerrainIndexBuffer::~FTerrainIndexBuffer()
+{
+	DEC_MEMORY_STAT_BY(STAT_DynamicTerrain_IndexDataMemory, GetAllocatedSize());
+}
+
+void FTerrainIndexBuffer::InitRHI()
+{
+	uint32 stride = Use16Bit ? sizeof(uint16) : sizeof(uint32);
+	uint32 size = GetNumIndices() * stride;
+	if (size == 0)
+	{
+		return;
+	}
+
+	FRHIResourceCreateInfo info;
+	void* data = nullptr;
+	IndexBufferRHI = RHICreateAndLockIndexBuffer(stride, size, BUF_Static, info, data);
+	FMemory::Memcpy(data, Use16Bit ? (void*)Indices16.GetData() : (void*)Indices32.GetData(), size);
+	RHIUnlockIndexBuffer(IndexBufferRHI);
+	INC_MEMORY_STAT_BY(STAT_DynamicTerrain_IndexBufferMemory, size);
+}
+
+void FTerrainIndexBuffer::ReleaseRHI()
+{
+	if (IndexBufferRHI.IsValid())
+	{
+		DEC_MEMORY_STAT_BY(STAT_DynamicTerrain_IndexBufferMemory, IndexBufferRHI->GetSize());
+	}
+	FIndexBuffer::ReleaseRHI();
+}
+
+void FTerrainIndexBuffer::SetIndices(const TArray<uint32>& InIndices, uint32 NumVertices)
+{
+	DEC_MEMORY_STAT_BY(STAT_DynamicTerrain_IndexDataMemory, GetAllocatedSize());
+	Use16Bit = NumVertices <= MAX_uint16 + 1;
+	Indices16.Empty();
+	Indices32.Empty();
+
+	if (Use16Bit)
+	{
+		Indices16.SetNumUninitialized(InIndices.Num());
+		for (int32 i = 0; i < InIndices.Num(); ++i)
+		{
+			Indices16[i] = (uint16)InIndices[i];
+		}
+	}
+	else
+	{
+		Indices32 = InIndices;
+	}
+	INC_MEMORY_STAT_BY(STAT_DynamicTerrain_IndexDataMemory, GetAllocatedSize());
+
+#if DO_GUARD_SLOW
+	// Verify that the narrowed triangle list matches the source list
+	for (int32 i = 0; i < InIndices.Num(); ++i)
+	{
+		checkSlow(GetIndex(i) == InIndices[i]);
+	}
+#endif
+}
+
+/// Shader Parameters ///
+
+// Binds the per-component uniform buffer of a terrain vertex factory and the per-LOD uniform buffer of the mesh batch
+class FTerrainVertexFactoryShaderParameters : public FVertexFactoryShaderParameters
+{
+public:
+	virtual void Bind(const FShaderParameterMap& ParameterMap) override {}
+	virtual void Serialize(FArchive& Ar) override {}
+
+	virtual void GetElementShaderBindings(const FSceneInterface* Scene, const FSceneView* View, const FMeshMaterialShader* Shader, const EVertexInputStreamType InputStreamType, ERHIFeatureLevel::Type FeatureLevel,
+		const FVertexFactory* VertexFactory, const FMeshBatchElement& BatchElement, FMeshDrawSingleShaderBindings& ShaderBindings, FVertexInputStreamArray& VertexStreams) const override
+	{
+		const FTerrainVertexFactory* factory = static_cast<const FTerrainVertexFactory*>(VertexFactory);
+		ShaderBindings.Add(Shader->GetUniformBufferParameter<FTerrainVertexFactoryParameters>(), factory->GetUniformBuffer());
+
+		const TUniformBufferRef<FTerrainLODParameters>* lod_buffer = (const TUniformBufferRef<FTerrainLODParameters>*)BatchElement.UserData;
+		check(lod_buffer != nullptr);
+		ShaderBindings.Add(Shader->GetUniformBufferParameter<FTerrainLODParameters>(), lod_buffer->GetReference());
+	}
+
+	virtual uint32 GetSize() const override
+	{
+		return sizeof(*this);
+	}
+};
+
+/// Vertex Factory Interface ///
+
+bool FTerrainVertexFactory::ShouldCompilePermutation(EShaderPlatform Platform, const FMaterial* Material, const FShaderType* ShaderType)
+{
+	// Like landscapes, terrain is only compiled for the default materials and surface materials flagged for it
+	return Material->IsSpecialEngineMaterial() || (Material->GetMaterialDomain() == MD_Surface && Material->IsUsedWithLandscape());
+}
+
+void FTerrainVertexFactory::ModifyCompilationEnvironment(const FVertexFactoryType* Type, EShaderPlatform Platform, const FMaterial* Material, FShaderCompilerEnvironment& OutEnvironment)
+{
+	FVertexFactory::ModifyCompilationEnvironment(Type, Platform, Material, OutEnvironment);
+}
+
+FVertexFactoryShaderParameters* FTerrainVertexFactory::ConstructShaderParameters(EShaderFrequency ShaderFrequency)
+{
+	if (ShaderFrequency == SF_Vertex)
+	{
+		return new FTerrainVertexFactoryShaderParameters();
+	}
+
+	return nullptr;
+}
+
+void FTerrainVertexFactory::InitRHI()
+{
+	// Create the vertex declaration
+	FVertexDeclarationElementList elements;
+	elements.Add(AccessStreamComponent(Data.HeightComponent, 0));
+	elements.Add(AccessStreamComponent(Data.NormalComponent, 1));
+	elements.Add(AccessStreamComponent(Data.MorphHeightComponent, 2));
+	InitDeclaration(elements);
+
+	// Create the uniform buffer
+	UniformBuffer = TUniformBufferRef<FTerrainVertexFactoryParameters>::CreateUniformBufferImmediate(Parameters, UniformBuffer_MultiFrame);
+}
+
+void FTerrainVertexFactory::ReleaseRHI()
+{
+	UniformBuffer.SafeRelease();
+	FVertexFactory::ReleaseRHI();
+}
+
+/// Terrain Interface ///
+
+void FTerrainVertexFactory::SetData(const FDataType& InData)
+{
+	check(IsInRenderingThread());
+	Data = InData;
+}
+
+void FTerrainVertexFactory::SetGridParameters(uint32 Width, float Spacing, FVector2D Offset)
+{
+	Parameters.GridParameters = FVector4(Width, Spacing, Offset.X, Offset.Y);
+
+	if (UniformBuffer.IsValid())
+	{
+		UniformBuffer.UpdateUniformBufferImmediate(Parameters);
+	}
+}
+
+void FTerrainVertexFactory::SetUVParameters(FVector2D Offset, float Tiling)
+{
+	Parameters.UVTransform = FVector4(Offset.X, Offset.Y, Tiling, 0.0f);
+
+	// Update the existing buffer in place so cached draw commands remain valid
+	if (UniformBuffer.IsValid())
+	{
+		UniformBuffer.UpdateUniformBufferImmediate(Parameters);
+	}
+}
+
+IMPLEMENT_VERTEX_FACTORY_TYPE(FTerrainVertexFactory, "/Plugin/DynamicTerrain/Private/TerrainVertexFactory.ush", true, false, true, false, false);
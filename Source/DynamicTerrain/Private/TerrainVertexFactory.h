@@ -0,0 +1,195 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "RenderResource.h"
+#include "VertexFactory.h"
+#include "UniformBuffer.h"
+
+#include "TerrainStat.h"
+
+// Per-component shader parameters for the terrain vertex factory
+BEGIN_GLOBAL_SHADER_PARAMETER_STRUCT(FTerrainVertexFactoryParameters, )
+	// X = the number of vertices in each row of the grid, Y = the local distance between vertices, ZW = the local position of the first vertex
+	SHADER_PARAMETER(FVector4, GridParameters)
+	// XY = the UV offset of the component in grid units, Z = UV tiling
+	SHADER_PARAMETER(FVector4, UVTransform)
+END_GLOBAL_SHADER_PARAMETER_STRUCT()
+
+// Per-LOD shader parameters for a terrain component, used to morph vertices before they disappear from the next LOD
+BEGIN_GLOBAL_SHADER_PARAMETER_STRUCT(FTerrainLODParameters, )
+	// X = the LOD, Y = the local height error of the LOD per pixel of error allowed, Z = the same for the next LOD,
+	// W = the local diagonal of the component
+	SHADER_PARAMETER(FVector4, MorphParameters)
+END_GLOBAL_SHADER_PARAMETER_STRUCT()
+
+// The normal of a single terrain vertex, stored as a 16 bit octahedral encoding
+// The tangent always lies in the XZ plane, so it is rebuilt from the normal in the vertex factory
+struct FTerrainNormalVertex
+{
+	int16 X;
+	int16 Y;
+
+	FTerrainNormalVertex() {}
+	// Encode a normal, the normal does not need to be normalized
+	explicit FTerrainNormalVertex(const FVector& Normal);
+
+	// Decode the normal
+	FVector ToFVector() const;
+};
+
+// A vertex buffer with no CPU copy, vertex data is written directly into the locked RHI buffer
+template<typename VertexType>
+class TTerrainVertexBuffer : public FVertexBuffer
+{
+public:
+	// Set the number of vertices in the buffer, must be called before initialization
+	void Init(uint32 InNumVertices)
+	{
+		NumVertices = InNumVertices;
+	}
+
+	virtual void InitRHI() override
+	{
+		FRHIResourceCreateInfo info;
+		VertexBufferRHI = RHICreateVertexBuffer(GetSize(), BUF_Static, info);
+		INC_MEMORY_STAT_BY(STAT_DynamicTerrain_VertexBufferMemory, GetSize());
+	}
+
+	virtual void ReleaseRHI() override
+	{
+		if (VertexBufferRHI.IsValid())
+		{
+			DEC_MEMORY_STAT_BY(STAT_DynamicTerrain_VertexBufferMemory, VertexBufferRHI->GetSize());
+		}
+		FVertexBuffer::ReleaseRHI();
+	}
+
+	// Lock the buffer to write new vertex data
+	VertexType* Lock()
+	{
+		return (VertexType*)RHILockVertexBuffer(VertexBufferRHI, 0, GetSize(), RLM_WriteOnly);
+	}
+
+	// Lock a range of vertices to write new vertex data, the rest of the buffer keeps its contents
+	VertexType* Lock(uint32 First, uint32 Count)
+	{
+		return (VertexType*)RHILockVertexBuffer(VertexBufferRHI, First * sizeof(VertexType), Count * sizeof(VertexType), RLM_WriteOnly);
+	}
+
+	void Unlock()
+	{
+		RHIUnlockVertexBuffer(VertexBufferRHI);
+	}
+
+	inline uint32 GetNumVertices() const
+	{
+		return NumVertices;
+	}
+
+	inline uint32 GetSize() const
+	{
+		return NumVertices * sizeof(VertexType);
+	}
+
+	// Get the size of the GPU buffer as it was allocated, zero before initialization
+	inline uint32 GetVideoMemorySize() const
+	{
+		return VertexBufferRHI.IsValid() ? VertexBufferRHI->GetSize() : 0;
+	}
+
+protected:
+	// The number of vertices in the buffer
+	uint32 NumVertices = 0;
+};
+
+// An index buffer that automatically uses 16 bit indices when every vertex can be addressed with them
+class FTerrainIndexBuffer : public FIndexBuffer
+{
+public:
+	virtual ~FTerrainIndexBuffer();
+
+	virtual void InitRHI() override;
+	virtual void ReleaseRHI() override;
+
+	// Set the index data, the index width is chosen from the number of vertices the indices address
+	void SetIndices(const TArray<uint32>& InIndices, uint32 NumVertices);
+
+	inline bool Is16Bit() const
+	{
+		return Use16Bit;
+	}
+
+	// Get the size of the GPU buffer as it was allocated, zero before initialization
+	inline uint32 GetVideoMemorySize() const
+	{
+		return IndexBufferRHI.IsValid() ? IndexBufferRHI->GetSize() : 0;
+	}
+
+	inline int32 GetNumIndices() const
+	{
+		return Use16Bit ? Indices16.Num() : Indices32.Num();
+	}
+
+	inline uint32 GetIndex(int32 Index) const
+	{
+		return Use16Bit ? Indices16[Index] : Indices32[Index];
+	}
+
+	// Get the size of the CPU copy of the index data
+	inline uint32 GetAllocatedSize() const
+	{
+		return Indices16.GetAllocatedSize() + Indices32.GetAllocatedSize();
+	}
+
+protected:
+	// Set to true when the buffer stores 16 bit indices
+	bool Use16Bit = false;
+	// The index data, only one of these arrays will be filled
+	TArray<uint16> Indices16;
+	TArray<uint32> Indices32;
+};
+
+// A vertex factory for terrain components
+// The only positional data stored per vertex is the height, XY positions and UVs are generated
+// in the shader from the vertex index and a per-component uniform buffer
+// Mesh batches carry a pointer to an LOD uniform buffer in their UserData
+class FTerrainVertexFactory : public FVertexFactory
+{
+	DECLARE_VERTEX_FACTORY_TYPE(FTerrainVertexFactory);
+
+public:
+	struct FDataType
+	{
+		FVertexStreamComponent HeightComponent;
+		FVertexStreamComponent NormalComponent;
+		FVertexStreamComponent MorphHeightComponent;
+	};
+
+	FTerrainVertexFactory(ERHIFeatureLevel::Type InFeatureLevel) : FVertexFactory(InFeatureLevel) {}
+
+	static bool ShouldCompilePermutation(EShaderPlatform Platform, const class FMaterial* Material, const class FShaderType* ShaderType);
+	static void ModifyCompilationEnvironment(const FVertexFactoryType* Type, EShaderPlatform Platform, const FMaterial* Material, FShaderCompilerEnvironment& OutEnvironment);
+	static FVertexFactoryShaderParameters* ConstructShaderParameters(EShaderFrequency ShaderFrequency);
+
+	virtual void InitRHI() override;
+	virtual void ReleaseRHI() override;
+
+	// Set the vertex streams used by the factory, must be called before initialization
+	void SetData(const FDataType& InData);
+	// Set the layout of the vertex grid
+	void SetGridParameters(uint32 Width, float Spacing, FVector2D Offset = FVector2D::ZeroVector);
+	// Set the UV offset (in vertices) and tiling of the component
+	void SetUVParameters(FVector2D Offset, float Tiling);
+
+	inline FUniformBufferRHIParamRef GetUniformBuffer() const
+	{
+		return UniformBuffer.GetReference();
+	}
+
+protected:
+	// The vertex streams bound to the factory
+	FDataType Data;
+	// Shader parameters for the component
+	FTerrainVertexFactoryParameters Parameters;
+	TUniformBufferRef<FTerrainVertexFactoryParameters> UniformBuffer;
+};
@@ -0,0 +1,151 @@
+#include "TerrainHorizonCuller.h"
+
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+// A square heightfield of components that share their edge vertices, in the terrain space the culler uses
+struct FTestHeightfield
+{
+	int32 Components = 0;
+	int32 Polygons = 0;
+	int32 Width = 0;
+	TArray<float> Heights;
+
+	FTestHeightfield(int32 NumComponents, int32 ComponentPolygons)
+	{
+		Components = NumComponents;
+		Polygons = ComponentPolygons;
+		Width = Components * Polygons + 1;
+
+		// Rolling hills crossed by a high ridge, so low views are hidden from whole parts of the map
+		Heights.SetNumUninitialized(Width * Width);
+		for (int32 y = 0; y < Width; ++y)
+		{
+			for (int32 x = 0; x < Width; ++x)
+			{
+				float hills = FMath::Sin(x * 0.09f) * FMath::Sin(y * 0.13f) * 12.0f;
+				float ridge = FMath::Max(0.0f, 40.0f - FMath::Abs(x - Width * 0.5f) * 4.0f);
+				Heights[y * Width + x] = hills + ridge;
+			}
+		}
+	}
+
+	float GetHeight(int32 X, int32 Y) const
+	{
+		return Heights[Y * Width + X];
+	}
+
+	// Get the height of the drawn surface, each cell is split from its first corner to its last like the mesh template
+	float GetSurfaceHeight(float X, float Y) const
+	{
+		int32 cx = FMath::Clamp(FMath::FloorToInt(X), 0, Width - 2);
+		int32 cy = FMath::Clamp(FMath::FloorToInt(Y), 0, Width - 2);
+		float u = X - cx;
+		float v = Y - cy;
+
+		float h00 = GetHeight(cx, cy);
+		float h10 = GetHeight(cx + 1, cy);
+		float h01 = GetHeight(cx, cy + 1);
+		float h11 = GetHeight(cx + 1, cy + 1);
+		return u >= v ? h00 + u * (h10 - h00) + v * (h11 - h10) : h00 + v * (h01 - h00) + u * (h11 - h01);
+	}
+
+	// March along the segment from the eye to a point and test whether the surface ever rises above it
+	bool IsVisible(const FVector& Eye, const FVector& Point) const
+	{
+		FVector delta = Point - Eye;
+		int32 steps = FMath::Max(FMath::CeilToInt(FVector2D(delta).Size() * 8.0f), 1);
+		for (int32 i = 1; i < steps; ++i)
+		{
+			FVector sample = Eye + delta * ((float)i / steps);
+			if (sample.Z < GetSurfaceHeight(sample.X, sample.Y) - KINDA_SMALL_NUMBER)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// A component is visible when any of its vertices can be seen
+	bool IsComponentVisible(const FVector& Eye, FIntPoint Component) const
+	{
+		for (int32 y = Component.Y * Polygons; y <= (Component.Y + 1) * Polygons; ++y)
+		{
+			for (int32 x = Component.X * Polygons; x <= (Component.X + 1) * Polygons; ++x)
+			{
+				if (IsVisible(Eye, FVector(x, y, GetHeight(x, y))))
+				{
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+};
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTerrainHorizonCullerTest, "DynamicTerrain.HorizonCuller.Conservative", EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FTerrainHorizonCullerTest::RunTest(const FString& Parameters)
+{
+	FTestHeightfield heightfield(6, 16);
+
+	FTerrainHorizonCuller culler;
+	for (int32 y = 0; y < heightfield.Components; ++y)
+	{
+		for (int32 x = 0; x < heightfield.Components; ++x)
+		{
+			const float* heights = &heightfield.Heights[y * heightfield.Polygons * heightfield.Width + x * heightfield.Polygons];
+			culler.SetComponent(FIntPoint(x, y), heights, heightfield.Width, heightfield.Polygons + 1, 0.0f);
+		}
+	}
+
+	// Walk the camera across the ridge and along the valley beside it, close to the ground and from higher up
+	const float extent = heightfield.Width - 1;
+	const FVector2D paths[][2] = {
+		{ FVector2D(2.0f, extent * 0.5f), FVector2D(extent - 2.0f, extent * 0.5f) },
+		{ FVector2D(extent * 0.2f, 2.0f), FVector2D(extent * 0.2f, extent - 2.0f) },
+		{ FVector2D(1.0f, 1.0f), FVector2D(extent - 1.0f, extent - 1.0f) },
+	};
+	const float eye_heights[] = { 1.5f, 10.0f, 60.0f };
+	const int32 path_steps = 12;
+
+	FIntRect grid(0, 0, heightfield.Components, heightfield.Components);
+	int32 num_culled = 0;
+	for (const FVector2D* path : paths)
+	{
+		for (float eye_height : eye_heights)
+		{
+			for (int32 step = 0; step <= path_steps; ++step)
+			{
+				FVector2D position = FMath::Lerp(path[0], path[1], (float)step / path_steps);
+				FVector eye(position, heightfield.GetSurfaceHeight(position.X, position.Y) + eye_height);
+
+				TBitArray<> occluded;
+				culler.GetOccluded(eye, grid, occluded);
+				for (int32 i = 0; i < occluded.Num(); ++i)
+				{
+					if (!occluded[i])
+					{
+						continue;
+					}
+
+					// Any component the culler hides must be hidden from every ray
+					++num_culled;
+					FIntPoint component(i % grid.Width(), i / grid.Width());
+					if (heightfield.IsComponentVisible(eye, component))
+					{
+						AddError(FString::Printf(TEXT("Component (%d, %d) was culled but is visible from (%.1f, %.1f, %.1f)"), component.X, component.Y, eye.X, eye.Y, eye.Z));
+					}
+				}
+			}
+		}
+	}
+
+	// The paths are only useful if they hide something
+	TestTrue(TEXT("Some components are culled along the camera paths"), num_culled > 0);
+	AddInfo(FString::Printf(TEXT("%d culled components were checked against the heightfield"), num_culled));
+	return true;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#include "Terrain.h"
+
+#include "TerrainHeightMap.h"
+#include "TerrainMeshTemplate.h"
+#include "TerrainRender.h"
+#include "TerrainStat.h"
+
+#include "Misc/AutomationTest.h"
+#include "Async/ParallelFor.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTerrainLoadRebuildBenchmark, "DynamicTerrain.Load.RebuildBenchmark", EAutomationTestFlags::EditorContext | EAutomationTestFlags::PerfFilter)
+
+bool FTerrainLoadRebuildBenchmark::RunTest(const FString& Parameters)
+{
+	// Derived data is no longer saved, so loading a terrain pays for copying every section out of the heightmap
+	// and for the vertex data and LOD errors each proxy builds from its section
+	const int32 components = 8;
+	const int32 iterations = 5;
+
+	for (uint32 size = 5; size <= 7; ++size)
+	{
+		TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> mesh_template = FTerrainMeshTemplate::Get(size);
+		uint32 width = mesh_template->Width;
+		int32 polygons = width - 1;
+
+		// The heightmap has a one vertex border around the components, like the terrain's own map
+		UHeightMap* map = NewObject<UHeightMap>();
+		map->Resize(components * polygons + 3, components * polygons + 3);
+		for (int32 y = 0; y < map->GetWidthY(); ++y)
+		{
+			for (int32 x = 0; x < map->GetWidthX(); ++x)
+			{
+				map->SetHeight(x, y, FMath::Sin(x * 0.05f) * FMath::Cos(y * 0.07f) * 50.0f);
+			}
+		}
+
+		double extract_time = MAX_dbl;
+		double build_time = MAX_dbl;
+		for (int32 i = 0; i < iterations; ++i)
+		{
+			// Copy each section from the heightmap in parallel, as ATerrain::RebuildProxies does
+			double start = FPlatformTime::Seconds();
+			TArray<TSharedPtr<FMapSection, ESPMode::ThreadSafe>> proxies;
+			proxies.SetNum(components * components);
+			ParallelFor(proxies.Num(), [&](int32 c) {
+				proxies[c] = MakeShareable(new FMapSection(width + 2, width + 2));
+				map->GetMapSection(proxies[c].Get(), FIntPoint((c % components) * polygons, (c / components) * polygons));
+				});
+			double middle = FPlatformTime::Seconds();
+
+			// Build what each proxy creates from its section when it is first rendered
+			TArray<float> heights, morph_heights, lod_errors;
+			TArray<FTerrainNormalVertex> normals;
+			heights.SetNumUninitialized(width * width);
+			morph_heights.SetNumUninitialized(width * width);
+			normals.SetNumUninitialized(width * width);
+			for (const TSharedPtr<FMapSection, ESPMode::ThreadSafe>& proxy : proxies)
+			{
+				FTerrainComponentSceneProxy::BuildVertices(*proxy, *mesh_template, heights.GetData(), normals.GetData(), morph_heights.GetData());
+				mesh_template->GetLODErrors(&proxy->Data[proxy->X + 1], proxy->X, lod_errors);
+			}
+			double end = FPlatformTime::Seconds();
+
+			extract_time = FMath::Min(extract_time, middle - start);
+			build_time = FMath::Min(build_time, end - middle);
+		}
+
+		FString result = FString::Printf(TEXT("Rebuild %dx%d components of size %u: sections %.3f ms, vertex data %.3f ms, %.3f ms per component"),
+			components, components, size, extract_time * 1000.0, build_time * 1000.0, (extract_time + build_time) * 1000.0 / (components * components));
+		UE_LOG(LogDynamicTerrain, Display, TEXT("%s"), *result);
+		AddInfo(result);
+
+		map->MarkPendingKill();
+	}
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include "TerrainMeshTemplate.h"
+
+#include "Terrain.h"
+
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+// The component sizes the terrain is normally built with
+static const uint32 TestComponentSizes[] = { 2, 3, 4, 5, 6, 7, 8 };
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTerrainMeshTemplateCacheTest, "DynamicTerrain.MeshTemplate.VertexCache", EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FTerrainMeshTemplateCacheTest::RunTest(const FString& Parameters)
+{
+	for (uint32 size : TestComponentSizes)
+	{
+		TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> mesh_template = FTerrainMeshTemplate::Get(size);
+		for (int32 lod = 0; lod < mesh_template->GetNumLODs(); ++lod)
+		{
+			// Grids with rows short enough for two of them to stay in the cache are already close to optimal in grid order
+			// Stitched variants fall back to grid order where it is better, so they only have to match it
+			int32 row_vertices = ((mesh_template->Width - 1) >> lod) + 1;
+			bool must_improve = row_vertices * 2 > FTerrainMeshTemplate::VertexCacheSize;
+
+			// The order the LOD was built in before it was optimized
+			TArray<uint32> grid_indices;
+			mesh_template->BuildGridIndices(grid_indices, 1 << lod);
+
+			// Stitched variants exist for every LOD that has a coarser LOD to stitch to
+			uint32 num_variants = lod < mesh_template->GetNumLODs() - 1 ? FTerrainMeshTemplate::NumEdgeVariants : 1;
+			for (uint32 edges = 0; edges < num_variants; ++edges)
+			{
+				TArray<uint32> optimized;
+				mesh_template->GetStitchedIndices(lod, edges, optimized);
+				TArray<uint32> grid;
+				mesh_template->StitchIndices(grid_indices, lod, edges, grid);
+
+				float optimized_ratio = FTerrainMeshTemplate::GetCacheMissRatio(optimized);
+				float grid_ratio = FTerrainMeshTemplate::GetCacheMissRatio(grid);
+				bool improved = must_improve && edges == 0 ? optimized_ratio < grid_ratio : optimized_ratio <= grid_ratio;
+				TestTrue(FString::Printf(TEXT("Size %u LOD %d edges %u: ACMR %.3f after optimization, %.3f in grid order"), size, lod, edges, optimized_ratio, grid_ratio), improved);
+			}
+		}
+	}
+
+	return true;
+}
+
+// Build a heightfield with features at every scale, so adaptive triangulations are split unevenly
+static void BuildTestHeights(uint32 Width, int32 Seed, TArray<float>& OutHeights)
+{
+	FRandomStream random(Seed);
+	OutHeights.SetNumUninitialized(Width * Width);
+	for (uint32 y = 0; y < Width; ++y)
+	{
+		for (uint32 x = 0; x < Width; ++x)
+		{
+			float hills = FMath::Sin(x * 0.11f) * FMath::Cos(y * 0.07f) * 40.0f;
+			float ridge = FMath::Max(0.0f, 20.0f - FMath::Abs((float)x - (float)y * 0.5f - Width * 0.25f) * 2.0f);
+			OutHeights[y * Width + x] = hills + ridge + random.FRandRange(-2.0f, 2.0f);
+		}
+	}
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTerrainMeshTemplateAdaptiveTest, "DynamicTerrain.MeshTemplate.AdaptiveWatertight", EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FTerrainMeshTemplateAdaptiveTest::RunTest(const FString& Parameters)
+{
+	for (uint32 size : TestComponentSizes)
+	{
+		TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> mesh_template = FTerrainMeshTemplate::Get(size);
+		uint32 width = mesh_template->Width;
+		uint32 tile = width - 1;
+
+		TArray<float> heights;
+		BuildTestHeights(width, size, heights);
+		TArray<float> errors;
+		mesh_template->GetAdaptiveErrors(heights.GetData(), width, errors);
+		TArray<float> lod_errors;
+		mesh_template->GetLODErrors(heights.GetData(), width, lod_errors);
+
+		// Test the thresholds each LOD is built with, as well as the full and the coarsest triangulation
+		TArray<float> thresholds = { 0.0f, 1.0e6f };
+		for (float lod_error : lod_errors)
+		{
+			thresholds.Add(FMath::Max(lod_error, 0.5f));
+		}
+
+		for (float threshold : thresholds)
+		{
+			TArray<uint32> indices;
+			mesh_template->GetAdaptiveIndices(errors, threshold, indices);
+
+			// Every vertex on the edge of the grid is used, so the component meets any neighbour
+			TBitArray<> used(false, width * width);
+			for (uint32 index : indices)
+			{
+				used[index] = true;
+			}
+			bool edges_used = true;
+			for (uint32 i = 0; i < width; ++i)
+			{
+				edges_used &= used[i] && used[tile * width + i] && used[i * width] && used[i * width + tile];
+			}
+			TestTrue(FString::Printf(TEXT("Size %u threshold %.2f: every edge vertex is used"), size, threshold), edges_used);
+
+			// Interior edges are shared by exactly two triangles and edges on the border of the grid by one, so there are no T-junctions
+			TMap<uint64, int32> edge_counts;
+			for (int32 i = 0; i + 2 < indices.Num(); i += 3)
+			{
+				for (int32 corner = 0; corner < 3; ++corner)
+				{
+					uint32 a = indices[i + corner];
+					uint32 b = indices[i + (corner + 1) % 3];
+					edge_counts.FindOrAdd(((uint64)FMath::Min(a, b) << 32) | FMath::Max(a, b))++;
+				}
+			}
+
+			bool watertight = true;
+			for (const TPair<uint64, int32>& edge : edge_counts)
+			{
+				uint32 a = edge.Key >> 32;
+				uint32 b = edge.Key & MAX_uint32;
+				uint32 ax = a % width, ay = a / width;
+				uint32 bx = b % width, by = b / width;
+				bool border = (ax == bx && (ax == 0 || ax == tile)) || (ay == by && (ay == 0 || ay == tile));
+				watertight &= edge.Value == (border ? 1 : 2);
+			}
+			TestTrue(FString::Printf(TEXT("Size %u threshold %.2f: every interior edge is shared by two triangles"), size, threshold), watertight);
+		}
+	}
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,96 @@
+#include "TerrainRender.h"
+
+#include "TerrainHeightMap.h"
+#include "TerrainMeshTemplate.h"
+#include "TerrainStat.h"
+
+#include "Misc/AutomationTest.h"
+#include "Async/ParallelFor.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+// The vertex generation the vector kernel replaced, one vertex at a time with the normal built from an FVector
+static void BuildVerticesScalar(const FMapSection& Section, const FTerrainMeshTemplate& Template, float* OutHeights, FTerrainNormalVertex* OutNormals, float* OutMorphHeights)
+{
+	uint32 width = Template.Width;
+	ParallelFor(width, [&](int32 y) {
+		for (uint32 x = 0; x < width; ++x)
+		{
+			uint32 i = y * width + x;
+			int32 map_x = x + 1;
+			int32 map_y = y + 1;
+			OutHeights[i] = Section.Data[map_y * Section.X + map_x];
+
+			float s01 = Section.Data[map_y * Section.X + map_x - 1];
+			float s21 = Section.Data[map_y * Section.X + map_x + 1];
+			float s10 = Section.Data[(map_y - 1) * Section.X + map_x];
+			float s12 = Section.Data[(map_y + 1) * Section.X + map_x];
+			OutNormals[i] = FTerrainNormalVertex(FVector(s01 - s21, s10 - s12, 2.0f));
+		}
+		Template.GetMorphHeights(&Section.Data[Section.X + 1], Section.X, y, OutMorphHeights + y * width);
+		});
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTerrainBuildVerticesBenchmark, "DynamicTerrain.Render.BuildVerticesBenchmark", EAutomationTestFlags::EditorContext | EAutomationTestFlags::PerfFilter)
+
+bool FTerrainBuildVerticesBenchmark::RunTest(const FString& Parameters)
+{
+	const int32 iterations = 20;
+
+	for (uint32 size = 5; size <= 8; ++size)
+	{
+		TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> mesh_template = FTerrainMeshTemplate::Get(size);
+		uint32 width = mesh_template->Width;
+		uint32 num_vertices = width * width;
+
+		// A section with a one vertex border, rough enough that no two normals are alike
+		FMapSection section(width + 2, width + 2);
+		FRandomStream random(size);
+		for (int32 i = 0; i < section.Data.Num(); ++i)
+		{
+			section.Data[i] = FMath::Sin(i * 0.37f) * 20.0f + random.FRandRange(-5.0f, 5.0f);
+		}
+
+		TArray<float> heights, scalar_heights;
+		TArray<FTerrainNormalVertex> normals, scalar_normals;
+		TArray<float> morph_heights, scalar_morph_heights;
+		heights.SetNumUninitialized(num_vertices);
+		scalar_heights.SetNumUninitialized(num_vertices);
+		normals.SetNumUninitialized(num_vertices);
+		scalar_normals.SetNumUninitialized(num_vertices);
+		morph_heights.SetNumUninitialized(num_vertices);
+		scalar_morph_heights.SetNumUninitialized(num_vertices);
+
+		// The fastest of several runs is kept for each path, so other work on the machine matters less
+		double scalar_time = MAX_dbl;
+		double vector_time = MAX_dbl;
+		for (int32 i = 0; i < iterations; ++i)
+		{
+			double start = FPlatformTime::Seconds();
+			BuildVerticesScalar(section, *mesh_template, scalar_heights.GetData(), scalar_normals.GetData(), scalar_morph_heights.GetData());
+			double middle = FPlatformTime::Seconds();
+			FTerrainComponentSceneProxy::BuildVertices(section, *mesh_template, heights.GetData(), normals.GetData(), morph_heights.GetData());
+			double end = FPlatformTime::Seconds();
+
+			scalar_time = FMath::Min(scalar_time, middle - start);
+			vector_time = FMath::Min(vector_time, end - middle);
+		}
+
+		FString result = FString::Printf(TEXT("Build vertices for size %u (%u vertices): scalar %.3f ms, vector %.3f ms, %.2fx"), size, num_vertices, scalar_time * 1000.0, vector_time * 1000.0, scalar_time / FMath::Max(vector_time, 1.0e-9));
+		UE_LOG(LogDynamicTerrain, Display, TEXT("%s"), *result);
+		AddInfo(result);
+
+		// Both paths must build the same vertices, normals may round differently in the last bit
+		bool match = FMemory::Memcmp(heights.GetData(), scalar_heights.GetData(), num_vertices * sizeof(float)) == 0;
+		match &= FMemory::Memcmp(morph_heights.GetData(), scalar_morph_heights.GetData(), num_vertices * sizeof(float)) == 0;
+		for (uint32 i = 0; i < num_vertices && match; ++i)
+		{
+			match = FMath::Abs(normals[i].X - scalar_normals[i].X) <= 1 && FMath::Abs(normals[i].Y - scalar_normals[i].Y) <= 1;
+		}
+		TestTrue(FString::Printf(TEXT("Size %u: the vector path matches the scalar path"), size), match);
+	}
+
+	return true;
+}
+
+#endif
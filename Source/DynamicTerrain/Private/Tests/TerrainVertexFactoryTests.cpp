@@ -0,0 +1,94 @@
+#include "TerrainVertexFactory.h"
+
+#include "TerrainMeshTemplate.h"
+
+#include "Misc/AutomationTest.h"
+
+#if WITH_DEV_AUTOMATION_TESTS
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTerrainIndexBufferWidthTest, "DynamicTerrain.VertexFactory.IndexWidth", EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FTerrainIndexBufferWidthTest::RunTest(const FString& Parameters)
+{
+	// Templates up to size 7 can be addressed with 16 bit indices, size 8 needs 32 bits
+	for (uint32 size = 2; size <= 8; ++size)
+	{
+		TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> mesh_template = FTerrainMeshTemplate::Get(size);
+		uint32 num_vertices = mesh_template->Width * mesh_template->Width;
+		for (int32 lod = 0; lod < mesh_template->GetNumLODs(); ++lod)
+		{
+			const TArray<uint32>& indices = mesh_template->LODIndices[lod];
+
+			// The same list is stored once at the width the template needs and once forced to 32 bits
+			FTerrainIndexBuffer narrow;
+			FTerrainIndexBuffer wide;
+			narrow.SetIndices(indices, num_vertices);
+			wide.SetIndices(indices, MAX_uint16 + 2);
+
+			TestEqual(FString::Printf(TEXT("Size %u LOD %d uses 16 bit indices"), size, lod), narrow.Is16Bit(), num_vertices <= MAX_uint16 + 1);
+			TestFalse(FString::Printf(TEXT("Size %u LOD %d forced to 32 bit indices"), size, lod), wide.Is16Bit());
+			TestEqual(FString::Printf(TEXT("Size %u LOD %d 16 bit index count"), size, lod), narrow.GetNumIndices(), indices.Num());
+			TestEqual(FString::Printf(TEXT("Size %u LOD %d 32 bit index count"), size, lod), wide.GetNumIndices(), indices.Num());
+
+			int32 mismatch = INDEX_NONE;
+			for (int32 i = 0; i < indices.Num() && mismatch == INDEX_NONE; ++i)
+			{
+				if (narrow.GetIndex(i) != indices[i] || wide.GetIndex(i) != indices[i])
+				{
+					mismatch = i;
+				}
+			}
+			TestEqual(FString::Printf(TEXT("Size %u LOD %d first index that differs from the source list"), size, lod), mismatch, (int32)INDEX_NONE);
+		}
+	}
+
+	return true;
+}
+
+IMPLEMENT_SIMPLE_AUTOMATION_TEST(FTerrainNormalEncodingTest, "DynamicTerrain.VertexFactory.NormalEncoding", EAutomationTestFlags::EditorContext | EAutomationTestFlags::EngineFilter)
+
+bool FTerrainNormalEncodingTest::RunTest(const FString& Parameters)
+{
+	// 16 bit octahedral components keep normals within a few thousandths of a degree
+	const float max_error_degrees = 0.01f;
+
+	// A Fibonacci sphere covers every direction evenly, the axes and the folds of the octahedron are added explicitly
+	const int32 num_directions = 100000;
+	TArray<FVector> directions;
+	directions.Reserve(num_directions + 10);
+	for (int32 i = 0; i < num_directions; ++i)
+	{
+		float z = 1.0f - 2.0f * (i + 0.5f) / num_directions;
+		float radius = FMath::Sqrt(FMath::Max(1.0f - z * z, 0.0f));
+		float angle = i * PI * (3.0f - FMath::Sqrt(5.0f));
+		directions.Add(FVector(radius * FMath::Cos(angle), radius * FMath::Sin(angle), z));
+	}
+	directions.Append({ FVector::ForwardVector, FVector::BackwardVector, FVector::RightVector, FVector::LeftVector, FVector::UpVector, FVector::DownVector });
+	directions.Append({ FVector(1.0f, 1.0f, 0.0f).GetSafeNormal(), FVector(-1.0f, 1.0f, 0.0f).GetSafeNormal(), FVector(1.0f, 0.0f, -1.0f).GetSafeNormal(), FVector(0.0f, -1.0f, -1.0f).GetSafeNormal() });
+
+	float worst = 0.0f;
+	FVector worst_direction = FVector::ZeroVector;
+	for (const FVector& direction : directions)
+	{
+		// The angle is found from both the sine and cosine, acos alone loses the small errors to float precision
+		FVector decoded = FTerrainNormalVertex(direction).ToFVector();
+		float error = FMath::RadiansToDegrees(FMath::Atan2(FVector::CrossProduct(direction, decoded).Size(), FVector::DotProduct(direction, decoded)));
+		if (error > worst)
+		{
+			worst = error;
+			worst_direction = direction;
+		}
+	}
+
+	AddInfo(FString::Printf(TEXT("Largest normal error %.5f degrees at %s"), worst, *worst_direction.ToString()));
+	TestTrue(FString::Printf(TEXT("Normal error %.5f degrees is under %.3f degrees"), worst, max_error_degrees), worst < max_error_degrees);
+
+	// Normals are encoded without being normalized first
+	FVector scaled(3.0f, -4.0f, 12.0f);
+	FVector decoded = FTerrainNormalVertex(scaled).ToFVector();
+	TestTrue(TEXT("Unnormalized normals decode to the same direction"), decoded.Equals(scaled.GetSafeNormal(), 1.0e-3f));
+
+	return true;
+}
+
+#endif
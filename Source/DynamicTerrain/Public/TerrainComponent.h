@@ -1,6 +1,7 @@
 #pragma once
 
 #include "TerrainHeightMap.h"
+#include "TerrainMeshTemplate.h"
 
 #include "CoreMinimal.h"
 #include "Components/MeshComponent.h"
@@ -9,6 +10,7 @@
 #include "TerrainComponent.generated.h"
 
 class ATerrain;
+struct FTerrainVertexData;
 
 UCLASS(HideCategories = (Object, LOD, Physics), EditInlineNew, ClassGroup = Rendering)
 class DYNAMICTERRAIN_API UTerrainComponent : public UMeshComponent, public IInterface_CollisionDataProvider
@@ -23,6 +25,7 @@ public:
 	virtual FPrimitiveSceneProxy* CreateSceneProxy() override;
 	virtual UBodySetup* GetBodySetup() override;
 	virtual int32 GetNumMaterials() const override;
+	virtual void GetResourceSizeEx(FResourceSizeEx& CumulativeResourceSize) override;
 
 	virtual bool GetPhysicsTriMeshData(struct FTriMeshCollisionData* CollisionData, bool InUseAllTriData) override;
 	virtual bool ContainsPhysicsTriMeshData(bool InUseAllTriData) const override { return true; }
@@ -36,8 +39,10 @@ private:
 public:
 	// Initialize the component
 	void Initialize(ATerrain* Terrain, TSharedPtr<FMapSection, ESPMode::ThreadSafe> Proxy, int32 X, int32 Y);
-	// Initialize mesh data
+	// Acquire the shared mesh topology for the current size, vertex data is always read from the map proxy
 	void CreateMeshData();
+	// Get the shared mesh topology of the component
+	TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> GetMeshTemplate();
 
 	// Set the size of the component
 	void SetSize(uint32 NewSize);
@@ -47,7 +52,18 @@ public:
 	void SetTiling(float NewTiling);
 	// Set LOD levels and scaling
 	void SetLODs(int32 NumLODs, float DistanceScale);
+	// Set the largest error in pixels an LOD can show on screen
+	void SetLODErrorThreshold(float Pixels);
+	// Set the number of LODs coarser than the main view that whole scene shadows use
+	void SetShadowLODBias(int32 Bias);
+	// Switch between regular grids and adaptive triangulations, the proxy is recreated when either setting changes
+	void SetAdaptiveTriangulation(bool Enable, float ErrorThreshold);
+	// Create or release the render resources of the component, collision and the map section are kept either way
+	void SetStreamedIn(bool NewStreamedIn);
+	// Check if the component has render resources
+	inline bool IsStreamedIn() const;
 	// Update rendering data from a heightmap section
+	// Vertex data is built on a worker thread, and a newer section supersedes any update that is still in flight
 	void Update(TSharedPtr<FMapSection, ESPMode::ThreadSafe> NewSection);
 
 	// Get the map data for this section
@@ -63,19 +79,20 @@ private:
 	// Verify that the map proxy exists
 	void VerifyMapProxy();
 
+	// Upload vertex data built by an update job and update collision, the data is discarded if a newer job has started
+	void FinishUpdate(int32 Version, TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData);
+
 	// Update collision data
 	void UpdateCollision();
+	// Start cooking collision on a worker thread, aborting any earlier cooks
+	void CookCollisionAsync();
 	// Finish asynchronous collision cooking
 	void FinishCollision(bool Success, UBodySetup* NewBodySetup);
 	// Create a collision body
 	UBodySetup* CreateBodySetup();
+	// Build mesh vertices for collision from the map proxy
+	void GetCollisionVertices(TArray<FVector>& OutVertices) const;
 
-	// The mesh indices
-	UPROPERTY(VisibleAnywhere)
-		TArray<uint32> IndexBuffer;
-	// The mesh vertices
-	UPROPERTY(VisibleAnywhere)
-		TArray<FVector> Vertices;
 
 	// The size of the component
 	UPROPERTY(VisibleAnywhere)
@@ -86,6 +103,9 @@ private:
 	// The offset of the component on the Y axis
 	UPROPERTY(VisibleAnywhere)
 		int32 YOffset;
+	// The number of components on each axis of the terrain, which decides the edges that are stitched
+	UPROPERTY(VisibleAnywhere)
+		FIntPoint ComponentCount;
 	// The UV Tiling of the component
 	UPROPERTY(VisibleAnywhere)
 		float Tiling;
@@ -95,9 +115,24 @@ private:
 	// The scaling factor for LOD transitions
 	UPROPERTY(VisibleAnywhere)
 		float LODScale;
+	// The largest error in pixels an LOD can show on screen
+	UPROPERTY(VisibleAnywhere)
+		float LODErrorThreshold;
+	// The number of LODs coarser than the main view that whole scene shadows use
+	UPROPERTY(VisibleAnywhere)
+		int32 ShadowLODBias;
+	// Set to true to draw an adaptive triangulation instead of regular grids
+	UPROPERTY(VisibleAnywhere)
+		bool AdaptiveTriangulation;
+	// The largest vertical error of the full detail adaptive triangulation
+	UPROPERTY(VisibleAnywhere)
+		float AdaptiveErrorThreshold;
+	// Set to false when the terrain has released the component's render resources because it is far from every view
+	UPROPERTY(VisibleAnywhere, Transient)
+		bool StreamedIn;
 
-	// The collision body for the object
-	UPROPERTY(Instanced)
+	// The collision body for the object, this is derived from the map proxy and rebuilt after loading
+	UPROPERTY(Transient)
 		UBodySetup* BodySetup;
 	// Queue of body setups that are being cooked asynchronously
 	UPROPERTY(Transient)
@@ -105,6 +140,12 @@ private:
 
 	// The render data for the terrain component
 	TSharedPtr<FMapSection, ESPMode::ThreadSafe> MapProxy;
+	// Incremented each time an update job starts, jobs that finish with an older version are discarded
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> UpdateVersion = MakeShared<FThreadSafeCounter, ESPMode::ThreadSafe>();
+	// The GPU memory used by the proxy's own buffers, set by the proxy on the rendering thread
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> VideoMemory = MakeShared<FThreadSafeCounter, ESPMode::ThreadSafe>();
+	// The mesh topology shared with every component of the same size
+	TSharedPtr<const FTerrainMeshTemplate, ESPMode::ThreadSafe> MeshTemplate;
 
 	friend class FTerrainComponentSceneProxy;
 };
\ No newline at end of file
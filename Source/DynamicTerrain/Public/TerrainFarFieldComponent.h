@@ -0,0 +1,89 @@
+#pragma once
+
+#include "TerrainHeightMap.h"
+#include "TerrainMeshTemplate.h"
+
+#include "CoreMinimal.h"
+#include "Components/MeshComponent.h"
+
+#include "TerrainFarFieldComponent.generated.h"
+
+class ATerrain;
+struct FTerrainVertexData;
+
+// Renders a single low resolution mesh of an entire terrain, which replaces the terrain's components past a distance
+// The mesh is split into one patch per component, and each view only draws the patches whose components are culled
+// The mesh sits slightly below the components so the patches bordering visible components hide any cracks between them
+UCLASS(HideCategories = (Object, LOD, Physics, Collision), ClassGroup = Rendering)
+class DYNAMICTERRAIN_API UTerrainFarFieldComponent : public UMeshComponent
+{
+	GENERATED_BODY()
+
+	/// Mesh Component Interface ///
+
+public:
+	UTerrainFarFieldComponent(const FObjectInitializer& ObjectInitializer);
+
+	virtual FPrimitiveSceneProxy* CreateSceneProxy() override;
+	virtual int32 GetNumMaterials() const override;
+	virtual void GetResourceSizeEx(FResourceSizeEx& CumulativeResourceSize) override;
+
+private:
+	virtual FBoxSphereBounds CalcBounds(const FTransform& LocalToWorld) const override;
+
+	/// Terrain Interface ///
+
+public:
+	// Build the mesh for the whole terrain from its heightmap
+	void Initialize(ATerrain* Terrain);
+	// Rebuild the patches of components whose map data changed
+	void UpdateComponents(const TArray<int32>& Components);
+	// Set the distance the mesh replaces the components at
+	void SetDistance(float NewDistance);
+	// Set UV tiling
+	void SetTiling(float NewTiling);
+
+	// Get the number of vertices along the X axis of the mesh
+	inline int32 GetVertexWidth() const
+	{
+		return ComponentCount.X * Resolution + 1;
+	}
+
+private:
+	// Find how far a patch needs to sink below the full resolution surface to stay under its component
+	void BuildPatchDepth(int32 Patch);
+	// Rebuild the vertices in a region of the mesh, the region is in vertices and includes its maximum
+	void BuildVertices(FTerrainVertexData& Data, FIntRect Region) const;
+
+	// The size of the terrain's components
+	UPROPERTY(VisibleAnywhere)
+		uint32 Size;
+	// The number of components on each axis
+	UPROPERTY(VisibleAnywhere)
+		FIntPoint ComponentCount;
+	// The number of quads along each side of a patch
+	UPROPERTY(VisibleAnywhere)
+		int32 Resolution;
+	// The number of LODs the components use
+	UPROPERTY(VisibleAnywhere)
+		int32 ComponentLODs;
+	// The distance the mesh replaces the components at
+	UPROPERTY(VisibleAnywhere)
+		float Distance;
+	// The UV Tiling of the terrain
+	UPROPERTY(VisibleAnywhere)
+		float Tiling;
+
+	// The heightmap the mesh is built from
+	UPROPERTY(Transient)
+		UHeightMap* Map;
+
+	// The vertex data of the mesh, edits rebuild the vertices of their patches in place and send those rows to the proxy
+	TSharedPtr<FTerrainVertexData, ESPMode::ThreadSafe> VertexData;
+	// How far each patch sinks below the full resolution surface, in local space
+	TArray<float> PatchDepths;
+	// The mesh topology shared with the terrain's components
+	TSharedPtr<const FTerrainMeshTemplate, ESPMode::ThreadSafe> MeshTemplate;
+
+	friend class FTerrainFarFieldSceneProxy;
+};
@@ -10,6 +10,10 @@ struct FMapSection
 	int32 X = 0;
 	int32 Y = 0;
 
+	// The height range of the section, excluding the one vertex border
+	float MinHeight = 0.0f;
+	float MaxHeight = 0.0f;
+
 	FMapSection() {};
 	FMapSection(int32 XWidth, int32 YWidth)
 	{
@@ -25,6 +29,10 @@ class DYNAMICTERRAIN_API UHeightMap : public UObject
 	GENERATED_BODY()
 
 public:
+	/// Engine Functions ///
+
+	virtual void GetResourceSizeEx(FResourceSizeEx& CumulativeResourceSize) override;
+
 	/// Blueprint Functions ///
 
 	// Resize the heightmap
@@ -38,7 +46,7 @@ public:
 
 	/// Native Functions ///
 
-	// Get a copy of a portion of the map
+	// Get a copy of a portion of the map and its height range
 	inline void GetMapSection(FMapSection* Section, FIntPoint Min);
 
 	// Get the height at a given vertex
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+// Flags for the edges of a component
+namespace ETerrainEdge
+{
+	enum Type : uint32
+	{
+		NegativeX = 1,
+		PositiveX = 2,
+		NegativeY = 4,
+		PositiveY = 8
+	};
+}
+
+// Immutable mesh topology shared by every terrain component of the same size
+// Components only store their own height data and reference the template for everything else
+class DYNAMICTERRAIN_API FTerrainMeshTemplate
+{
+public:
+	// Get the shared template for a component size, the template is built the first time it is requested
+	static TSharedRef<const FTerrainMeshTemplate, ESPMode::ThreadSafe> Get(uint32 Size);
+
+	// Get the number of LODs in the template
+	inline int32 GetNumLODs() const
+	{
+		return LODIndices.Num();
+	}
+
+	// The component size the template was built for
+	uint32 Size = 0;
+	// The number of vertices along each side of the grid
+	uint32 Width = 0;
+	// Triangle indices for each LOD, LOD 0 is the full resolution grid
+	// Triangles are ordered for the vertex cache, so stitched variants that keep their order are ordered well too
+	TArray<TArray<uint32>> LODIndices;
+
+	// The number of index variants for each LOD, one for every combination of edges bordering a coarser component
+	static const uint32 NumEdgeVariants = 16;
+
+	// Build the triangles of an LOD with the edges in EdgeMask stitched to a neighbour one LOD coarser
+	// Vertices on a stitched edge are collapsed onto the coarser grid and the triangles that vanish are removed
+	// The triangles keep the optimized order of the LOD, or grid order when that misses the vertex cache less
+	void GetStitchedIndices(int32 LOD, uint32 EdgeMask, TArray<uint32>& OutIndices) const;
+	// Stitch the edges in EdgeMask of any triangle list of an LOD, keeping the order of the triangles that remain
+	void StitchIndices(const TArray<uint32>& Indices, int32 LOD, uint32 EdgeMask, TArray<uint32>& OutIndices) const;
+	// Fill an index buffer with a grid of triangles spaced by the given stride, in rows from the first vertex
+	void BuildGridIndices(TArray<uint32>& Indices, uint32 Stride) const;
+
+	// Get the height of the surface of an LOD at a vertex of the full resolution grid
+	float GetLODHeight(const float* Heights, uint32 Pitch, int32 LOD, uint32 X, uint32 Y) const;
+	// Get the heights one row of vertices morph towards before they disappear from the mesh
+	// Each vertex morphs to the next LOD after the coarsest LOD it is part of, vertices on the edge of the grid never morph
+	void GetMorphHeights(const float* Heights, uint32 Pitch, uint32 Row, float* OutMorphHeights) const;
+
+	// Get the largest vertical distance between each LOD and the full resolution surface
+	// Heights points to the first vertex of the grid and Pitch is the distance between rows
+	// Errors never decrease from one LOD to the next
+	void GetLODErrors(const float* Heights, uint32 Pitch, TArray<float>& OutErrors) const;
+
+	// Get the error of removing each vertex from a right-triangulated irregular network of the grid
+	// The error of a vertex includes the errors of every vertex that depends on it, so any threshold gives a mesh without cracks
+	// Vertices on the edge of the grid are always kept, so adaptive components match their neighbours at any threshold
+	void GetAdaptiveErrors(const float* Heights, uint32 Pitch, TArray<float>& OutErrors) const;
+	// Build the triangles of a right-triangulated irregular network whose vertical error stays under MaxError
+	// Triangles are split along their longest edge until the vertex in the middle of the edge can be removed
+	void GetAdaptiveIndices(const TArray<float>& Errors, float MaxError, TArray<uint32>& OutIndices) const;
+
+	// The number of vertices the GPU's post-transform cache is assumed to hold, both when optimizing and when measuring
+	static const int32 VertexCacheSize = 32;
+
+	// Reorder triangles so that vertices are reused while they are still in the GPU's post-transform cache
+	// This uses Tom Forsyth's linear-speed vertex cache optimisation, the original order is kept if its miss ratio is lower
+	static void OptimizeVertexCache(TArray<uint32>& Indices, uint32 NumVertices);
+	// Get the average number of vertices transformed per triangle with a FIFO cache of the given size
+	static float GetCacheMissRatio(const TArray<uint32>& Indices, int32 CacheSize = VertexCacheSize);
+
+protected:
+	FTerrainMeshTemplate(uint32 ComponentSize);
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "TerrainHeightMap.h"
+#include "TerrainMeshTemplate.h"
+
+#include "CoreMinimal.h"
+#include "Components/MeshComponent.h"
+
+#include "TerrainQuadtreeComponent.generated.h"
+
+class ATerrain;
+
+// A node of the terrain quadtree, covering a square of 2^Level by 2^Level components with a single grid of the component size
+struct FTerrainQuadtreeNode
+{
+	// The level of the node, level 0 nodes cover a single component
+	int32 Level = 0;
+	// The position of the node in the grid of nodes on its level
+	FIntPoint Position = FIntPoint::ZeroValue;
+	// Heights sampled every 2^Level vertices of the heightmap, with a one vertex border
+	TSharedPtr<FMapSection, ESPMode::ThreadSafe> Section;
+	// The largest vertical distance between the node's grid and the full resolution surface, in local space
+	// This is an upper bound built from the errors of the node's children
+	float Error = 0.0f;
+};
+
+// Renders an entire terrain as a quadtree of fixed resolution grids
+// Distant nodes cover many components with one draw, so draw calls and primitives grow logarithmically with map size
+// The terrain's own components stay in the world for collision but are hidden while this component renders
+UCLASS(HideCategories = (Object, LOD, Physics, Collision), ClassGroup = Rendering)
+class DYNAMICTERRAIN_API UTerrainQuadtreeComponent : public UMeshComponent
+{
+	GENERATED_BODY()
+
+	/// Mesh Component Interface ///
+
+public:
+	UTerrainQuadtreeComponent(const FObjectInitializer& ObjectInitializer);
+
+	virtual FPrimitiveSceneProxy* CreateSceneProxy() override;
+	virtual int32 GetNumMaterials() const override;
+
+private:
+	virtual FBoxSphereBounds CalcBounds(const FTransform& LocalToWorld) const override;
+
+	/// Terrain Interface ///
+
+public:
+	// Build every node of the quadtree from the terrain's heightmap, the nodes are built on a worker thread
+	// The previous proxy keeps drawing until the new nodes are ready
+	void Initialize(ATerrain* Terrain);
+	// Rebuild the nodes that cover components whose map data changed on a worker thread
+	// While a job is running the components stay pending, and are built once it finishes
+	void UpdateComponents(const TArray<int32>& Components);
+	// Set the largest error in pixels a node can show on screen
+	void SetLODErrorThreshold(float Pixels);
+	// Set the number of LODs coarser than the main view that whole scene shadows use
+	void SetShadowLODBias(int32 Bias);
+	// Set UV tiling
+	void SetTiling(float NewTiling);
+
+	// Get the index of a node, or INDEX_NONE if the node is not completely inside the terrain
+	int32 GetNodeIndex(int32 Level, int32 X, int32 Y) const;
+	// Get the number of levels in the quadtree
+	inline int32 GetNumLevels() const
+	{
+		return LevelSizes.Num();
+	}
+
+private:
+	// Start a job that builds the given nodes from a snapshot of the heightmap under them, superseding any job still running
+	void StartBuild(const TArray<int32>& Indices);
+	// Start a job that builds the nodes covering every pending component
+	void StartPendingBuild();
+	// Take the nodes built by a job, the nodes are discarded if a newer job has started
+	void FinishBuild(int32 Version, const TArray<int32>& Indices, const TArray<FTerrainQuadtreeNode>& NewNodes);
+
+	// Copy the heights a node is built from, at the resolution of its children and with the node's border
+	static void SampleNode(const UHeightMap& Map, uint32 Size, const FTerrainQuadtreeNode& Node, FMapSection& Samples);
+	// Copy the map data of a node from its samples, this can be called on any thread
+	static void BuildNodeSection(const FMapSection& Samples, uint32 Size, FTerrainQuadtreeNode& Node);
+	// Set the error of a node from its samples and the largest error of its children, this can be called on any thread
+	static void BuildNodeError(const FMapSection& Samples, uint32 Size, float ChildError, FTerrainQuadtreeNode& Node);
+	// Get the index of a node in a layout of levels
+	static int32 GetNodeIndex(const TArray<FIntPoint>& Sizes, const TArray<int32>& Offsets, int32 Level, int32 X, int32 Y);
+
+	// The size of the terrain's components
+	UPROPERTY(VisibleAnywhere)
+		uint32 Size;
+	// The number of components on each axis
+	UPROPERTY(VisibleAnywhere)
+		FIntPoint ComponentCount;
+	// The UV Tiling of the terrain
+	UPROPERTY(VisibleAnywhere)
+		float Tiling;
+	// The largest error in pixels a node can show on screen
+	UPROPERTY(VisibleAnywhere)
+		float LODErrorThreshold;
+	// The number of LODs coarser than the main view that whole scene shadows use
+	UPROPERTY(VisibleAnywhere)
+		int32 ShadowLODBias;
+
+	// The heightmap the nodes are built from
+	UPROPERTY(Transient)
+		UHeightMap* Map;
+
+	// Every node of the quadtree, ordered by level and then by position
+	TArray<FTerrainQuadtreeNode> Nodes;
+	// The number of nodes on each axis of each level
+	TArray<FIntPoint> LevelSizes;
+	// The index of the first node of each level
+	TArray<int32> LevelOffsets;
+	// The mesh topology shared with the terrain's components
+	TSharedPtr<const FTerrainMeshTemplate, ESPMode::ThreadSafe> MeshTemplate;
+
+	// Set to true once every node of the current layout has been built
+	bool NodesBuilt = false;
+	// Set to true while a build job is running
+	bool Building = false;
+	// Components that changed since the running job sampled the heightmap, their nodes are built after it
+	TArray<int32> PendingComponents;
+	// Incremented each time a build job starts, jobs that finish with an older version are discarded
+	TSharedRef<FThreadSafeCounter, ESPMode::ThreadSafe> BuildVersion = MakeShared<FThreadSafeCounter, ESPMode::ThreadSafe>();
+
+	friend class FTerrainQuadtreeSceneProxy;
+};